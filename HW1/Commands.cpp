@@ -7,11 +7,31 @@
 #include <sstream>
 #include <linux/limits.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <iomanip>
+#include <sys/stat.h>
+#include <spawn.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <chrono>
+#include <limits>
+#include <atomic>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <deque>
+#include <dirent.h>
+#include <memory>
 #include "Commands.h"
 
 using namespace std;
 
+extern char** environ;
+
 #if 0
 #define FUNC_ENTRY()  \
   cout << __PRETTY_FUNCTION__ << " --> " << endl;
@@ -24,6 +44,8 @@ using namespace std;
 #endif
 
 const string WHITESPACE = " \n\r\t\f\v";
+// anything bash would expand, quote, redirect or chain; seeing one of these means we hand the line to bash
+const string SHELL_METACHARS = "*?[]'\"\\$`|&;<>(){}~#=!";
 
 string _ltrim(const string &s) {
     size_t start = s.find_first_not_of(WHITESPACE);
@@ -39,20 +61,50 @@ string _trim(const string &s) {
     return _rtrim(_ltrim(s));
 }
 
-int _parseCommandLine(const char* cmd_line, char** args) {
-    FUNC_ENTRY()
+void CommandLine::parse(const char* cmd_line) {
+    size_t length = strlen(cmd_line);
+    arena.assign(cmd_line, cmd_line + length + 1);
+    words.clear();
+    size_t i = 0;
+    while (true) {
+        while (i < length && isspace((unsigned char) arena[i])) {
+            i++;
+        }
+        if (i >= length) {
+            break;
+        }
+        words.push_back(&arena[i]);
+        while (i < length && !isspace((unsigned char) arena[i])) {
+            i++;
+        }
+        arena[i++] = '\0';
+    }
+    words.push_back(nullptr);
+}
 
-    int i = 0;
-    istringstream iss(_trim(string(cmd_line)).c_str());
-    for (string s; iss >> s;) {
-        args[i] = (char*) malloc(s.length() + 1);
-        memset(args[i], 0, s.length() + 1);
-        strcpy(args[i], s.c_str());
-        args[++i] = nullptr;
+/**
+* Drops a trailing & from the last word, and the word itself if that's all it was
+*/
+void CommandLine::removeBackgroundSign() {
+    if (size() == 0) {
+        return;
+    }
+    char* last = words[size() - 1];
+    size_t length = strlen(last);
+    if (last[length - 1] != '&') {
+        return;
+    }
+    if (length == 1) {
+        words.pop_back();
+        words.back() = nullptr;
+    } else {
+        last[length - 1] = '\0';
     }
-    return i;
+}
 
-    FUNC_EXIT()
+string _firstWord(const char* cmd_line) {
+    string cmd_s = _ltrim(cmd_line);
+    return cmd_s.substr(0, cmd_s.find_first_of(WHITESPACE));
 }
 
 bool _isBackgroundCommand(const char* cmd_line) {
@@ -61,6 +113,32 @@ bool _isBackgroundCommand(const char* cmd_line) {
     return str[str.find_last_not_of(whitespace)] == '&';
 }
 
+/**
+* Pipelines are run natively only when every stage is plain words. Anything else bash has to parse:
+* quoting, ||, ;, &&, $(...), (...), {...}, redirections, globs
+*/
+bool _isPipeCommand(const char* cmd_line) {
+    string str(cmd_line);
+    if (str.find('|') == string::npos || str.find("||") != string::npos) {
+        return false;
+    }
+    // the trailing & of a background pipeline is smash's, not a metacharacter of the last stage
+    size_t last = str.find_last_not_of(WHITESPACE);
+    if (str[last] == '&' && (last == 0 || str[last - 1] != '|')) {
+        str.erase(last);
+    }
+    // with the | and |& separators left out, no metacharacter may remain
+    string stages;
+    for (size_t i = 0; i < str.size(); ++i) {
+        if (str[i] != '|') {
+            stages += str[i];
+        } else if (i + 1 < str.size() && str[i + 1] == '&') {
+            ++i;
+        }
+    }
+    return stages.find_first_of(SHELL_METACHARS) == string::npos;
+}
+
 void _removeBackgroundSign(char* cmd_line) {
     const string whitespace = " \t\n";
     const string str(cmd_line);
@@ -81,71 +159,484 @@ void _removeBackgroundSign(char* cmd_line) {
 }
 
 
+bool _hasShellMetachars(const char* cmd_line) {
+    return string(cmd_line).find_first_of(SHELL_METACHARS) != string::npos;
+}
+
+/**
+* Looks @param name up in PATH the way execvp would. @param depends_on_cwd (may be null) is set when a
+* relative PATH entry (like "." or an empty one) was searched, so the answer may change with a cd
+* @return the full path of the executable, or an empty string if there is none
+*/
+string _resolveCommandPath(const string& name, bool* depends_on_cwd = nullptr) {
+    if (name.find('/') != string::npos) {
+        return name;
+    }
+    const char* path_env = getenv("PATH");
+    if (path_env == nullptr) {
+        return "";
+    }
+    istringstream dirs(path_env);
+    for (string dir; getline(dirs, dir, ':');) {
+        // an empty PATH entry stands for the current directory
+        string full_path = (dir.empty() ? "." : dir) + "/" + name;
+        if (depends_on_cwd != nullptr && full_path[0] != '/') {
+            *depends_on_cwd = true;
+        }
+        struct stat st;
+        if (stat(full_path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(full_path.c_str(), X_OK) == 0) {
+            return full_path;
+        }
+    }
+    return "";
+}
+
+/**
+* Launches a command in process group @param pgid, or in a new group of its own when it's 0 (the same as
+* setpgrp() in a forked child), applying @param file_actions (may be null) in the child.
+* posix_spawn is built on clone(CLONE_VM|CLONE_VFORK), so unlike fork() the launch cost doesn't
+* grow with smash's memory. @param exec_path is tried first when it's set; bash -c @param cmd_line
+* runs the command otherwise, or when exec_path can't be executed
+* @return the pid of the child, or -1 with errno set
+*/
+pid_t _spawnCommand(const string& exec_path, char** exec_args, const char* cmd_line,
+                    pid_t pgid, const posix_spawn_file_actions_t* file_actions) {
+    // whatever smash printed so far comes before the child's output
+    cout.flush();
+    posix_spawnattr_t attr;
+    int err = posix_spawnattr_init(&attr);
+    if (err == 0) {
+        err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    }
+    if (err == 0) {
+        err = posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    pid_t pid = -1;
+    if (err == 0) {
+        err = ENOENT;
+        if (!exec_path.empty()) {
+            err = posix_spawn(&pid, exec_path.c_str(), file_actions, &attr, exec_args, environ);
+        }
+        // bash would get the same arguments in a single string, no shorter
+        if (err != 0 && err != E2BIG) {
+            // metacharacters, unknown command or a failed exec: let bash handle it (and report errors)
+            char* bash_args[] = {(char*) "bash", (char*) "-c", (char*) cmd_line, nullptr};
+            err = posix_spawn(&pid, BASH_PATH, file_actions, &attr, bash_args, environ);
+        }
+    }
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
+
+/**
+* Spawns the external command @param cmd_line (without a background sign) like _spawnCommand, given its words
+* as @param exec_args. Simple commands are exec'ed directly, saving a bash startup per command
+*/
+pid_t _spawnExternal(const char* cmd_line, char** exec_args, CommandPathCache* path_cache,
+                     pid_t pgid = 0, const posix_spawn_file_actions_t* file_actions = nullptr) {
+	string exec_path;
+	if (!_hasShellMetachars(cmd_line) && exec_args[0] != nullptr) {
+		exec_path = path_cache->lookup(exec_args[0]);
+	}
+	return _spawnCommand(exec_path, exec_args, cmd_line, pgid, file_actions);
+}
+
+/**
+* The errors of worker threads (cp's), which mustn't touch cout. They are kept, in order, until the thread
+* that started the workers has joined them and passes them on with report()
+*/
+struct WorkerErrors {
+	pthread_mutex_t mutex;
+	vector<pair<bool, string>> messages; // true for stderr
+	WorkerErrors() {
+		pthread_mutex_init(&mutex, nullptr);
+	}
+	~WorkerErrors() {
+		pthread_mutex_destroy(&mutex);
+	}
+	void add(bool is_stderr, const string& msg) {
+		pthread_mutex_lock(&mutex);
+		messages.push_back(make_pair(is_stderr, msg));
+		pthread_mutex_unlock(&mutex);
+	}
+	void report();
+};
+
+// set in a worker thread, to where its errors go
+thread_local WorkerErrors* worker_errors = nullptr;
+
 void _printError(string error) {
-    cout << "smash error: " << error << endl;
+    if (worker_errors != nullptr) {
+        worker_errors->add(false, "smash error: " + error);
+        return;
+    }
+    cout << "smash error: " << error << '\n';
+}
+
+/**
+* perror for smash itself, what's still buffered on stdout comes out first
+*/
+void _perror(const char* msg) {
+	if (worker_errors != nullptr) {
+		worker_errors->add(true, string(msg) + ": " + strerror(errno));
+		return;
+	}
+	cout.flush();
+	perror(msg);
+}
+
+/**
+* Prints the errors, or hands them to the errors of this thread if it is a worker itself
+*/
+void WorkerErrors::report() {
+	for (auto& msg : messages) {
+		if (worker_errors != nullptr) {
+			worker_errors->add(msg.first, msg.second);
+		} else if (msg.first) {
+			cout.flush();
+			cerr << msg.second << endl;
+		} else {
+			cout << msg.second << '\n';
+		}
+	}
+	messages.clear();
 }
 
 string _getCWD(){
 	char cwd[PATH_MAX];
 	if (!getcwd(cwd, sizeof(cwd))) {
-		perror("smash error: getcwd failed");
+		_perror("smash error: getcwd failed");
 		return "";
 	} else {
 		return string(cwd);
 	}
 }
 
-Command::Command(const char* cmd_line) {
-	this->cmd = cmd_line;
-	this->args_num = _parseCommandLine(cmd_line, this->args);
+Command::Command(const char* cmd_line) : cmd(cmd_line), words(cmd_line) {
+	this->args = words.argv();
+	this->args_num = words.size();
 }
 
 void ExternalCommand::execute() {
-	bool is_bg = false;
-	char new_cmd[COMMAND_ARGS_MAX_LENGTH];
-
-	if (_isBackgroundCommand(cmd)) {
-		is_bg = true;
-		strcpy(new_cmd, cmd);
-		_removeBackgroundSign(new_cmd);
+	bool is_bg = _isBackgroundCommand(cmd);
+	string exec_cmd(cmd);
+	if (is_bg) {
+		_removeBackgroundSign(&exec_cmd[0]);
+		// the words were parsed with the &
+		words.removeBackgroundSign();
 	}
 
-	pid_t pid = fork();
-	if (pid == 0) {
-		// child process
-		setpgrp();
-		if (_isBackgroundCommand(cmd)) {
-			execl(BASH_PATH, "bash", "-c", new_cmd, nullptr);
-		} else {
-			execl(BASH_PATH, "bash", "-c", cmd, nullptr);
-		}
-		exit(-1);
-	} else if (pid > 0) {
+	pid_t pid = _spawnExternal(exec_cmd.c_str(), words.argv(), path_cache);
+	if (pid > 0) {
 		// father process
 		if (is_bg) {
 			this->jobs->addJob(cmd, pid);
 			return;
 		} else {
 			// adding new fg_job
-			auto* fg_job = new JobsList::JobEntry(cmd, 0, pid, time(nullptr));
-			jobs->setFgJob(fg_job);
-			int status = 0;
-			int val = waitpid(pid, &status, WUNTRACED);
-			if (val == -1) {
-				perror("smash error: waitpid failed");
-				return;
-			} else if (val == pid) {
-				if (WIFSTOPPED(status)) {
-					jobs->getJobByPid(pid)->setJobStatus(JobsList::JobStatus::Stopped);
-					jobs->setFgJob(nullptr);
-				}
+			jobs->setFgJob(JobsList::JobEntry(cmd, 0, pid, time(nullptr)));
+			jobs->waitForFgJob(pid);
+		}
+	} else {
+		// spawn error
+		_perror("smash error: fork failed");
+		return;
+	}
+}
+
+FdStreamBuf::FdStreamBuf(int fd, size_t max_size, volatile sig_atomic_t* cancel)
+		: fd(fd), max_size(max_size), cancel(cancel), buffer(FD_STREAM_BUF_SIZE) {
+	setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+FdStreamBuf::~FdStreamBuf() {
+	sync();
+}
+
+/**
+* Writes out whatever is buffered, retrying on short writes
+* @return false if the fd can't be written to anymore (e.g. the reading end is closed)
+*/
+bool FdStreamBuf::writeBuffer() {
+	char* pos = pbase();
+	while (pos < pptr()) {
+		ssize_t written = write(fd, pos, pptr() - pos);
+		if (written == -1) {
+			if (errno == EINTR || (errno == EAGAIN && waitWritable())) {
+				continue;
 			}
+			setp(buffer.data(), buffer.data() + buffer.size());
+			return false;
+		}
+		pos += written;
+	}
+	setp(buffer.data(), buffer.data() + buffer.size());
+	return true;
+}
+
+/**
+* Waits until a non-blocking fd takes more output
+* @return false once *cancel is set. It's checked with SIGTSTP and SIGINT blocked and ppoll() unblocks
+* them atomically, so a handler setting it can't slip in between and leave ppoll() waiting.
+* They are unblocked there even if the caller blocked them, this is where a stuck stage gets cancelled
+*/
+bool FdStreamBuf::waitWritable() {
+	sigset_t fg_signals, orig_mask;
+	sigemptyset(&fg_signals);
+	sigaddset(&fg_signals, SIGTSTP);
+	sigaddset(&fg_signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &fg_signals, &orig_mask);
+	sigset_t wait_mask = orig_mask;
+	sigdelset(&wait_mask, SIGTSTP);
+	sigdelset(&wait_mask, SIGINT);
+	bool writable = false;
+	while (cancel == nullptr || !*cancel) {
+		struct pollfd poll_fd = {fd, POLLOUT, 0};
+		int ready = ppoll(&poll_fd, 1, nullptr, &wait_mask);
+		if (ready > 0) {
+			writable = true;
+			break;
+		}
+		if (ready == -1 && errno != EINTR) {
+			break;
+		}
+	}
+	sigprocmask(SIG_SETMASK, &orig_mask, nullptr);
+	return writable;
+}
+
+int FdStreamBuf::overflow(int c) {
+	if (buffer.size() < max_size) {
+		// grow rather than write, so the output of one command still goes out in a single write
+		size_t used = pptr() - pbase();
+		buffer.resize(std::min(buffer.size() * 2, max_size));
+		setp(buffer.data(), buffer.data() + buffer.size());
+		pbump((int) used);
+	} else if (!writeBuffer()) {
+		return traits_type::eof();
+	}
+	if (c != traits_type::eof()) {
+		*pptr() = (char)c;
+		pbump(1);
+	}
+	return traits_type::not_eof(c);
+}
+
+int FdStreamBuf::sync() {
+	return writeBuffer() ? 0 : -1;
+}
+
+/**
+* Splits the command line at each | into stages, a |& also pipes the stderr of the stage on its left
+* @return false if a stage is empty
+*/
+bool PipeCommand::parseStages(const string& cmd_line) {
+	size_t start = 0;
+	while (true) {
+		size_t bar = cmd_line.find('|', start);
+		PipeStage stage;
+		stage.cmd_line = _trim(cmd_line.substr(start, bar == string::npos ? string::npos : bar - start));
+		stage.pipe_stderr = false;
+		if (stage.cmd_line.empty()) {
+			return false;
 		}
+		if (bar == string::npos) {
+			stages.push_back(stage);
+			return true;
+		}
+		start = bar + 1;
+		if (start < cmd_line.size() && cmd_line[start] == '&') {
+			stage.pipe_stderr = true;
+			start++;
+		}
+		stages.push_back(stage);
+	}
+}
+
+/**
+* Built-ins registered as running in process (they only print) are run inside smash
+*/
+bool PipeCommand::runsInProcess(const PipeStage& stage) {
+	const BuiltInTable::Entry* builtin = SmallShell::getInstance().findBuiltIn(_firstWord(stage.cmd_line.c_str()));
+	return builtin != nullptr && builtin->runs_in_process;
+}
+
+volatile sig_atomic_t PipeCommand::stage_running = 0;
+volatile sig_atomic_t PipeCommand::stage_interrupted = 0;
+
+/**
+* Runs a built-in stage in smash itself, with cout pointed at the stage's pipe.
+* The pipe is written without blocking, so that a ctrl-Z stopping its reader gives smash back
+*/
+void PipeCommand::runInProcess(const PipeStage& stage, int out_fd) {
+	Command* builtin = SmallShell::getInstance().createCommand(stage.cmd_line.c_str(), _firstWord(stage.cmd_line.c_str()));
+	if (out_fd == -1) {
+		builtin->execute();
 	} else {
-		// fork error
-		perror("smash error: fork failed");
+		cout.flush();
+		if (fcntl(out_fd, F_SETFL, O_NONBLOCK) == -1) {
+			_perror("smash error: fcntl failed");
+		}
+		stage_interrupted = 0;
+		FdStreamBuf pipe_buf(out_fd, FD_STREAM_BUF_SIZE, &stage_interrupted);
+		stage_running = 1;
+		streambuf* stdout_buf = cout.rdbuf(&pipe_buf);
+		builtin->execute();
+		cout.flush();
+		cout.rdbuf(stdout_buf);
+		stage_running = 0;
+		// a closed reading end only means nobody wanted the output
+		cout.clear();
+	}
+	delete builtin;
+}
+
+/**
+* Starts a stage with @param in_fd as its stdin and @param out_fd as its stdout (and stderr for |&),
+* -1 meaning smash's own. External stages are spawned, built-in ones run in a forked smash
+* @return the pid of the stage or -1 with errno set
+*/
+pid_t PipeCommand::startStage(const PipeStage& stage, int in_fd, int out_fd, pid_t pgid) {
+	CommandLine stage_words(stage.cmd_line.c_str());
+	if (stage_words.size() == 0 || SmallShell::getInstance().findBuiltIn(stage_words[0]) == nullptr) {
+		posix_spawn_file_actions_t file_actions;
+		posix_spawn_file_actions_init(&file_actions);
+		// the pipe fds themselves are O_CLOEXEC, only the dup2'ed copies survive the exec
+		if (in_fd != -1) {
+			posix_spawn_file_actions_adddup2(&file_actions, in_fd, STDIN_FILENO);
+		}
+		if (out_fd != -1) {
+			posix_spawn_file_actions_adddup2(&file_actions, out_fd, STDOUT_FILENO);
+			if (stage.pipe_stderr) {
+				posix_spawn_file_actions_adddup2(&file_actions, out_fd, STDERR_FILENO);
+			}
+		}
+		pid_t pid = _spawnExternal(stage.cmd_line.c_str(), stage_words.argv(), path_cache, pgid, &file_actions);
+		posix_spawn_file_actions_destroy(&file_actions);
+		return pid;
+	}
+
+	Command* builtin = SmallShell::getInstance().createCommand(stage.cmd_line.c_str(), stage_words[0]);
+	cout.flush();
+	pid_t pid = fork();
+	if (pid == 0) {
+		// child process, a copy of smash running just this built-in
+		setpgid(0, pgid);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		if (in_fd != -1) {
+			dup2(in_fd, STDIN_FILENO);
+		}
+		if (out_fd != -1) {
+			dup2(out_fd, STDOUT_FILENO);
+			if (stage.pipe_stderr) {
+				dup2(out_fd, STDERR_FILENO);
+			}
+		}
+		builtin->execute();
+		cout.flush();
+		_exit(0);
+	}
+	if (pid > 0) {
+		// set here as well, the next stage may be spawned into the group before the child gets to run
+		setpgid(pid, pgid ? pgid : pid);
+	}
+	delete builtin;
+	return pid;
+}
+
+void PipeCommand::execute() {
+	string cmd_line(cmd);
+	bool is_bg = _isBackgroundCommand(cmd);
+	if (is_bg) {
+		cmd_line = cmd_line.substr(0, cmd_line.find_last_of('&'));
+	}
+	if (!parseStages(cmd_line)) {
+		_printError("pipe: invalid arguments");
 		return;
 	}
+
+	// every stage joins the process group of the first one, so signals reach the whole pipeline
+	pid_t pgid = 0;
+	vector<pid_t> procs;
+	// in-process stages and the write end of their pipe, run once every process is started
+	vector<pair<size_t, int>> in_process;
+	int in_fd = -1;
+	for (size_t i = 0; i < stages.size(); ++i) {
+		int pipe_fds[2] = {-1, -1};
+		if (i + 1 < stages.size() && pipe2(pipe_fds, O_CLOEXEC) == -1) {
+			_perror("smash error: pipe failed");
+			break;
+		}
+		pid_t pid = 0;
+		// nothing could cancel a background stage writing to a full pipe, so those are always forked
+		if (!is_bg && runsInProcess(stages[i])) {
+			// its input is never read, closing it now lets the stage on the left see a broken pipe
+			in_process.push_back(make_pair(i, pipe_fds[1]));
+			pipe_fds[1] = -1;
+		} else {
+			pid = startStage(stages[i], in_fd, pipe_fds[1], pgid);
+		}
+		if (in_fd != -1 && close(in_fd) == -1) {
+			_perror("smash error: close failed");
+		}
+		if (pipe_fds[1] != -1 && close(pipe_fds[1]) == -1) {
+			_perror("smash error: close failed");
+		}
+		in_fd = pipe_fds[0];
+		if (pid == -1) {
+			_perror("smash error: fork failed");
+			break;
+		}
+		if (pid == 0) {
+			continue;
+		}
+		if (pgid == 0) {
+			pgid = pid;
+		}
+		procs.push_back(pid);
+	}
+	if (in_fd != -1 && close(in_fd) == -1) {
+		_perror("smash error: close failed");
+	}
+
+	// the ctrl-Z/ctrl-C handlers change the jobs list, so they are held off while smash sets the fg job
+	// and runs its own stages. They get in only while a stage waits for its pipe (see waitWritable())
+	sigset_t fg_signals, orig_mask;
+	sigemptyset(&fg_signals);
+	sigaddset(&fg_signals, SIGTSTP);
+	sigaddset(&fg_signals, SIGINT);
+	sigprocmask(SIG_BLOCK, &fg_signals, &orig_mask);
+
+	// the whole pipeline is a single job, known by its process group id
+	if (!procs.empty()) {
+		if (is_bg) {
+			jobs->addJob(cmd, pgid, 0, procs);
+		} else {
+			jobs->setFgJob(JobsList::JobEntry(cmd, 0, pgid, time(nullptr), procs));
+		}
+	}
+
+	// the processes are running by now, so writing into their pipes can't block forever
+	if (!in_process.empty()) {
+		sighandler_t sigpipe_handler = signal(SIGPIPE, SIG_IGN);
+		for (auto& stage : in_process) {
+			runInProcess(stages[stage.first], stage.second);
+			if (stage.second != -1 && close(stage.second) == -1) {
+				_perror("smash error: close failed");
+			}
+		}
+		signal(SIGPIPE, sigpipe_handler);
+	}
+	sigprocmask(SIG_SETMASK, &orig_mask, nullptr);
+
+	if (!procs.empty() && !is_bg) {
+		jobs->waitForFgJob(pgid);
+	}
 }
 
 void ChangeDirCommand::execute() {
@@ -161,7 +652,7 @@ void ChangeDirCommand::execute() {
 		string last_wd = SmallShell::getInstance().getLastWd();
 		if (strcmp(path, "-") == 0) {
 			if (chdir(last_wd.c_str()) != 0) {
-				perror("smash error: chdir failed");
+				_perror("smash error: chdir failed");
 				return;
 			} else {
 				SmallShell::getInstance().setLastWd(curr_wd);
@@ -169,7 +660,7 @@ void ChangeDirCommand::execute() {
 			}
 		} else {
 			if (chdir(path) != 0) {
-				perror("smash error: chdir failed");
+				_perror("smash error: chdir failed");
 				return;
 			} else {
 				SmallShell::getInstance().setLastWd(curr_wd);
@@ -180,7 +671,7 @@ void ChangeDirCommand::execute() {
 }
 
 void GetCurrDirCommand::execute() {
-	cout << _getCWD() << endl;
+	cout << _getCWD() << '\n';
 }
 
 ShowPidCommand::ShowPidCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {
@@ -188,15 +679,20 @@ ShowPidCommand::ShowPidCommand(const char* cmd_line) : BuiltInCommand(cmd_line)
 }
 
 void ShowPidCommand::execute() {
-    cout << "smash pid is " << pid << endl;
+    cout << "smash pid is " << pid << '\n';
 }
 
 void QuitCommand::execute() {
 	if (args_num > 1 && string(args[1]) == "kill") {
 		jobs->removeFinishedJobs();
-		cout << "smash: sending SIGKILL signal to " << jobs->getJobsListSize() << " jobs:" << endl;
+		cout << "smash: sending SIGKILL signal to " << jobs->getJobsListSize() << " jobs:\n";
 		jobs->killAllJobs();
 	}
+	if (getpid() != SmallShell::getInstance().getPid()) {
+		// a forked copy of smash (a pipeline stage), smash's exit handlers aren't its to run
+		cout.flush();
+		_exit(0);
+	}
 	exit(0);
 }
 
@@ -232,10 +728,135 @@ void CommandsHistory::printHistory() {
 
     vector<CommandHistoryEntry>::iterator entry;
     for (entry = history_for_print.begin(); entry != history_for_print.end(); ++entry) {
-        cout << right << setw(5) << entry->getEntrySeqNum() << "  " << entry->getCmdLine() << endl;
+        cout << right << setw(5) << entry->getEntrySeqNum() << "  " << entry->getCmdLine() << '\n';
     }
 }
 
+CommandPathCache::CommandPathCache() {
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		_perror("smash error: inotify_init1 failed");
+	}
+}
+
+CommandPathCache::~CommandPathCache() {
+	if (inotify_fd != -1) {
+		close(inotify_fd);
+	}
+}
+
+/**
+* Drops every entry once PATH is not the one the entries were resolved with,
+* or inotify reports that an executable may have appeared in or left one of its directories
+*/
+void CommandPathCache::validate() {
+	const char* path_env = getenv("PATH");
+	string curr_path_env = path_env ? path_env : "";
+	bool changed = curr_path_env != cached_path_env;
+
+	if (inotify_fd != -1) {
+		// drain all pending events, any of them makes the cache stale
+		char events[4096];
+		while (read(inotify_fd, events, sizeof(events)) > 0) {
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return;
+	}
+
+	entries.clear();
+	if (curr_path_env != cached_path_env && inotify_fd != -1) {
+		// re-watch from scratch: closing the descriptor drops all the old watches
+		close(inotify_fd);
+		inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		istringstream dirs(curr_path_env);
+		for (string dir; inotify_fd != -1 && getline(dirs, dir, ':');) {
+			if (dir.empty() || dir[0] != '/') {
+				// relative to whatever the cwd is at lookup time, results found through them aren't cached
+				continue;
+			}
+			// directories that don't exist (yet) can't be watched, nothing would be found there anyway
+			inotify_add_watch(inotify_fd, dir.c_str(),
+			                  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB
+			                  | IN_DELETE_SELF | IN_MOVE_SELF);
+		}
+	}
+	cached_path_env = curr_path_env;
+}
+
+/**
+* Resolves @param name like _resolveCommandPath, remembering the result for the next lookups.
+* Names containing a '/', names that are not found and names whose lookup went through a relative
+* PATH entry (a cd may change the answer) are not cached
+*/
+string CommandPathCache::lookup(const string& name, bool count_hit) {
+	if (name.find('/') != string::npos) {
+		return name;
+	}
+	validate();
+	auto it = entries.find(name);
+	if (it == entries.end()) {
+		bool depends_on_cwd = false;
+		string path = _resolveCommandPath(name, &depends_on_cwd);
+		if (path.empty() || depends_on_cwd) {
+			return path;
+		}
+		it = entries.emplace(name, CacheEntry(path)).first;
+	}
+	if (count_hit) {
+		it->second.hit();
+	}
+	return it->second.getPath();
+}
+
+void CommandPathCache::forget(const string& name) {
+	entries.erase(name);
+}
+
+void CommandPathCache::clear() {
+	entries.clear();
+}
+
+void CommandPathCache::printCache() {
+	validate();
+	if (entries.empty()) {
+		cout << "hash: hash table empty\n";
+		return;
+	}
+	// sorted by name, unordered_map iteration order would change from run to run
+	vector<string> names;
+	for (auto& entry : entries) {
+		names.push_back(entry.first);
+	}
+	sort(names.begin(), names.end());
+	cout << "hits\tcommand\n";
+	for (const string& name : names) {
+		CacheEntry& entry = entries.at(name);
+		cout << right << setw(4) << entry.getHits() << "\t" << entry.getPath() << '\n';
+	}
+}
+
+void HashCommand::execute() {
+	if (args_num == 1) {
+		path_cache->printCache();
+	} else if (args_num == 2 && string(args[1]) == "-r") {
+		path_cache->clear();
+	} else if (args_num > 2 && string(args[1]) == "-d") {
+		for (int i = 2; i < args_num; ++i) {
+			path_cache->forget(args[i]);
+		}
+	} else if (args[1][0] == '-') {
+		_printError("hash: invalid arguments");
+	} else {
+		for (int i = 1; i < args_num; ++i) {
+			if (path_cache->lookup(args[i], false).empty()) {
+				_printError("hash: " + string(args[i]) + ": not found");
+			}
+		}
+	}
+}
+
 HistoryCommand::HistoryCommand(const char* cmd_line, CommandsHistory* history) : BuiltInCommand(cmd_line) {
 	this->history = history;
 }
@@ -244,170 +865,217 @@ void HistoryCommand::execute() {
 	this->history->printHistory();
 }
 
-JobsList::JobEntry::JobEntry(string cmd_line, int jobId, pid_t pid, time_t added_time)
-	: cmd_line(cmd_line), jid(jobId), pid(pid), added_time(added_time), job_status(JobStatus::Running) {
+JobsList::JobEntry::JobEntry(string cmd_line, int jobId, pid_t pid, time_t added_time, vector<pid_t> procs)
+	: cmd_line(cmd_line), jid(jobId), pid(pid), added_time(added_time), job_status(JobStatus::Running), procs(procs) {
+	if (this->procs.empty()) {
+		this->procs.push_back(pid);
+	}
+}
+
+void JobsList::JobEntry::removeProc(pid_t proc) {
+	procs.erase(remove(procs.begin(), procs.end(), proc), procs.end());
 }
 
-JobsList::JobsList() {
+JobsList::JobsList() : fg_entry("", 0, 0, 0) {
 	max_jid = 0;
+	fg_job = nullptr;
 }
 
-void JobsList::addJob(string cmd_line, pid_t pid, int jid) {
+void JobsList::addJob(string cmd_line, pid_t pid, int jid, vector<pid_t> procs) {
 	if (jid == 0) {
-		JobEntry new_entry(cmd_line, ++max_jid, pid, time(nullptr));
-		jobs.push_back(new_entry);
-	} else {
-		JobEntry new_entry(cmd_line, jid, pid, time(nullptr));
-		jobs.push_back(new_entry);
+		jid = ++max_jid;
+	} else if (jid > max_jid) {
+		max_jid = jid;
+	}
+	JobEntry* job = &jobs.emplace(jid, JobEntry(cmd_line, jid, pid, time(nullptr), procs)).first->second;
+	jids.insert(jid);
+	// the job's pid (its process group id) stays indexed for as long as the job lives,
+	// the other processes only until they are reaped
+	jobs_by_pid[pid] = job;
+	for (pid_t proc : job->getProcs()) {
+		jobs_by_pid[proc] = job;
 	}
 }
 
 void JobsList::printJobsList() {
-	// sorting jobs list according to jid
-	sort(jobs.begin(), jobs.end());
-
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it!=jobs.end()) {
-		time_t elapsed = time(nullptr) - it->getAddedTime();
-		cout << "[" << it->getJobId() << "] " << it->getCmdLine() << " : " << it->getJobPid();
+	// jids is kept ordered, no sorting needed
+	for (int jid : jids) {
+		JobEntry& job = jobs.at(jid);
+		time_t elapsed = time(nullptr) - job.getAddedTime();
+		cout << "[" << job.getJobId() << "] " << job.getCmdLine() << " : " << job.getJobPid();
 		cout << " " << to_string(elapsed) << " secs";
-		if (it->getJobStatus() == JobStatus::Stopped) {
+		if (job.getJobStatus() == JobStatus::Stopped) {
 			cout << " (stopped)";
 		}
-		cout << endl;
-		it++;
+		cout << '\n';
 	}
 }
 
 void JobsList::killAllJobs() {
-    vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-	    pid_t pid = it->getJobPid();
-        if (kill(pid, SIGKILL) == -1) {
-            perror("smash error: kill failed");
-        } else {
-        	cout << pid << ": " << it->getCmdLine() << endl;
-        }
-        ++it;
-    }
+	for (int jid : jids) {
+		JobEntry& job = jobs.at(jid);
+		pid_t pid = job.getJobPid();
+		if (kill(-pid, SIGKILL) == -1) {
+			_perror("smash error: kill failed");
+		} else {
+			cout << pid << ": " << job.getCmdLine() << '\n';
+		}
+	}
 	max_jid = 0;
 }
 
+volatile sig_atomic_t JobsList::child_changed = 1;
+
 void JobsList::removeFinishedJobs() {
+	// no SIGCHLD since the last call, so no child has finished
+	if (!child_changed) {
+		return;
+	}
+	child_changed = 0;
+
 	pid_t pid;
-	int val = 0;
 	int status = 0;
-	vector<JobEntry>::iterator it = jobs.begin();
-
-	while (it != jobs.end()) {
-		pid = it->getJobPid();
-		val = waitpid(pid, &status, WNOHANG);
-		if (val == -1) {
-			perror("smash error: waitpid failed");
+	// only the children that actually finished are reported, stopped ones are left alone (no WUNTRACED)
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		JobEntry* job = getJobByPid(pid);
+		if (job == nullptr) {
+			// a pipeline stage of the fg job, reaped while a built-in of the same pipeline ran
+			if (fg_job != nullptr) {
+				fg_job->removeProc(pid);
+			}
 			continue;
-		} else if (val == pid) {
-			max_jid = getLastJob()->getJobId();
-			it = jobs.erase(it);
-		} else {
-			++it;
+		}
+		job->removeProc(pid);
+		if (job->getProcs().empty()) {
+			removeJobById(job->getJobId());
+		} else if (pid != job->getJobPid()) {
+			jobs_by_pid.erase(pid);
 		}
 	}
-	if (getJobsListSize() != 0) {
-		max_jid = getLastJob()->getJobId();
-	} else {
-		max_jid = 0;
+	if (pid == -1 && errno != ECHILD) {
+		_perror("smash error: waitpid failed");
 	}
 }
 
 void JobsList::removeJobById(int jobId) {
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (it->getJobId() == jobId) {
-			jobs.erase(it);
-			return;
-		} else {
-			++it;
-		}
+	auto it = jobs.find(jobId);
+	if (it == jobs.end()) {
+		return;
 	}
-	max_jid = getLastJob()->getJobId();
+	jobs_by_pid.erase(it->second.getJobPid());
+	for (pid_t proc : it->second.getProcs()) {
+		jobs_by_pid.erase(proc);
+	}
+	stopped_jids.erase(jobId);
+	jids.erase(jobId);
+	jobs.erase(it);
+	max_jid = jids.empty() ? 0 : *jids.rbegin();
 }
 
 void JobsList::moveToFg(JobEntry* job_entry) {
 	pid_t pid = job_entry->getJobPid();
-	cout << job_entry->getCmdLine() << " : " << pid << endl;
-	if (kill(pid, SIGCONT) == -1) {
-		perror("smash error: kill failed");
+	cout << job_entry->getCmdLine() << " : " << pid << '\n';
+	// out before the job gets to print anything
+	cout.flush();
+	if (kill(-pid, SIGCONT) == -1) {
+		_perror("smash error: kill failed");
 	} else {
 		// setting job_status as Running and making it the fg_job
-		fg_job = new JobEntry(job_entry->getCmdLine(), job_entry->getJobId(), job_entry->getJobPid(), job_entry->getAddedTime());
+		setFgJob(*job_entry);
 		fg_job->setJobStatus(JobsList::JobStatus::Running);
 		removeJobById(job_entry->getJobId());
+		waitForFgJob(pid);
+	}
+}
+
+/**
+* Waits until every process of the fg job (process group @param pgid) has finished, or until the job is stopped.
+* Returns right away if ctrl-Z or ctrl-C already took the job away, e.g. while a pipeline stage ran in smash
+*/
+void JobsList::waitForFgJob(pid_t pgid) {
+	JobEntry* job = fg_job;
+	if (job == nullptr || job->getJobPid() != pgid) {
+		return;
+	}
+	sigset_t fg_signals;
+	sigemptyset(&fg_signals);
+	sigaddset(&fg_signals, SIGTSTP);
+	sigaddset(&fg_signals, SIGINT);
+
+	while (!job->getProcs().empty()) {
 		int status = 0;
-		int val = waitpid(pid, &status, WUNTRACED);
-		if (val == -1) {
-			perror("smash error: waitpid failed");
+		pid_t pid = waitpid(-pgid, &status, WUNTRACED);
+		if (pid == -1) {
+			if (errno != ECHILD) {
+				_perror("smash error: waitpid failed");
+			}
+			break;
+		}
+		if (WIFSTOPPED(status)) {
+			// normally the ctrl-Z handler has already moved the job to the jobs list
+			if (getJobByPid(pgid) == nullptr) {
+				addJob(job->getCmdLine(), pgid, job->getJobId(), job->getProcs());
+			}
+			setJobStatus(getJobByPid(pgid), JobStatus::Stopped);
+			break;
 		}
+		// the signal handlers read the fg job, keep them out while it changes
+		sigprocmask(SIG_BLOCK, &fg_signals, nullptr);
+		job->removeProc(pid);
+		sigprocmask(SIG_UNBLOCK, &fg_signals, nullptr);
+	}
+	if (fg_job == job) {
+		clearFgJob();
 	}
 }
 
-void JobsList::setFgJob(class JobsList::JobEntry * job_entry) {
-	fg_job = job_entry;
-}
+/**
+* Copies @param job_entry into the fg slot, the slot keeps its buffers so an fg command allocates nothing here
+*/
+void JobsList::setFgJob(const JobEntry& job_entry) {
+	// the signal handlers see no fg job while the slot is written
+	fg_job = nullptr;
+	fg_entry = job_entry;
+	fg_job = &fg_entry;
+}
+
+/**
+* Forgets the fg job. The slot keeps its contents until the next fg command, so a waitForFgJob() that the
+* signal handlers cut short can still read it
+*/
+void JobsList::clearFgJob() {
+	fg_job = nullptr;
+}
 
 JobsList::JobEntry* JobsList::getFgJob() {
 	return fg_job;
 }
 
-JobsList::JobEntry* JobsList::getJobById(int jid) {
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (jid == it->getJobId()) {
-			return &(*it);
-		} else {
-			++it;
-		}
+void JobsList::setJobStatus(JobEntry* job_entry, JobStatus new_status) {
+	job_entry->setJobStatus(new_status);
+	if (new_status == JobStatus::Stopped) {
+		stopped_jids.insert(job_entry->getJobId());
+	} else {
+		stopped_jids.erase(job_entry->getJobId());
 	}
-	return nullptr;
+}
+
+JobsList::JobEntry* JobsList::getJobById(int jid) {
+	auto it = jobs.find(jid);
+	return it == jobs.end() ? nullptr : &it->second;
 }
 
 JobsList::JobEntry* JobsList::getJobByPid(pid_t pid) {
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (it->getJobPid() == pid) {
-			return &(*it);
-		} else {
-			++it;
-		}
-	}
-	return nullptr;
+	auto it = jobs_by_pid.find(pid);
+	return it == jobs_by_pid.end() ? nullptr : it->second;
 }
 
 JobsList::JobEntry* JobsList::getLastJob() {
-	JobEntry* last_job = nullptr;
-	int last_jid = 0;
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (it->getJobId() > last_jid) {
-			last_jid = it->getJobId();
-			last_job = &(*it);
-		}
-		++it;
-	}
-	return last_job;
+	return jids.empty() ? nullptr : &jobs.at(*jids.rbegin());
 }
 
 JobsList::JobEntry* JobsList::getLastStoppedJob() {
-	JobEntry* last_stopped_job = nullptr;
-	int last_stopped_jid = 0;
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (it->getJobStatus() == JobStatus::Stopped && it->getJobId() > last_stopped_jid) {
-			last_stopped_jid = it->getJobId();
-			last_stopped_job = &(*it);
-		}
-		++it;
-	}
-	return last_stopped_job;
+	return stopped_jids.empty() ? nullptr : &jobs.at(*stopped_jids.rbegin());
 }
 
 int JobsList::getJobsListSize() {
@@ -415,15 +1083,7 @@ int JobsList::getJobsListSize() {
 }
 
 bool JobsList::containsStoppedJobs() {
-	vector<JobEntry>::iterator it = jobs.begin();
-	while (it != jobs.end()) {
-		if (it->getJobStatus() == JobStatus::Stopped) {
-			return true;
-		} else {
-			++it;
-		}
-	}
-	return false;
+	return !stopped_jids.empty();
 }
 
 void JobsCommand::execute() {
@@ -454,10 +1114,10 @@ void KillCommand::execute() {
 	} else {
 		pid_t job_pid = jobs->getJobById(jid)->getJobPid();
 		sig_num = (-1)*(sig_num);
-		if (kill(job_pid, sig_num) == -1) {
-			perror("smash error: kill failed");
+		if (kill(-job_pid, sig_num) == -1) {
+			_perror("smash error: kill failed");
 		} else {
-			cout << "signal number " << sig_num << " was sent to pid " << job_pid << endl;
+			cout << "signal number " << sig_num << " was sent to pid " << job_pid << '\n';
 		}
 	}
 }
@@ -517,11 +1177,12 @@ void BackgroundCommand::execute() {
 			} else {
 				JobsList::JobEntry* job = jobs->getJobById(jid);
 				pid_t pid = job->getJobPid();
-				cout << job->getCmdLine() << " : " << pid << endl;
-				if (kill(pid, SIGCONT) == -1) {
-					perror("smash error: kill failed");
+				cout << job->getCmdLine() << " : " << pid << '\n';
+				cout.flush();
+				if (kill(-pid, SIGCONT) == -1) {
+					_perror("smash error: kill failed");
 				} else {
-					job->setJobStatus(JobsList::JobStatus::Running);
+					jobs->setJobStatus(job, JobsList::JobStatus::Running);
 				}
 			}
 		}
@@ -533,125 +1194,1404 @@ void BackgroundCommand::execute() {
 			// get last stopped job
 			JobsList::JobEntry* last_stopped_job = jobs->getLastStoppedJob();
 			pid_t pid = last_stopped_job->getJobPid();
-			cout << last_stopped_job->getCmdLine() << " : " << pid << endl;
-			if (kill(pid, SIGCONT) == -1) {
-				perror("smash error: kill failed");
+			cout << last_stopped_job->getCmdLine() << " : " << pid << '\n';
+			cout.flush();
+			if (kill(-pid, SIGCONT) == -1) {
+				_perror("smash error: kill failed");
 			} else {
-				last_stopped_job->setJobStatus(JobsList::JobStatus::Running);
+				jobs->setJobStatus(last_stopped_job, JobsList::JobStatus::Running);
 			}
 		}
 	}
 }
 
-void CopyCommand::execute() {
-	if (args_num != 3 || args[1] == nullptr || args[2] == nullptr){
-		_printError("cp: invalid arguments");
-		return;
+// the ways cp can copy a file, each falling back to the next one; io_uring falls back to copy_file_range
+enum CopyMethod { COPY_REFLINK, COPY_FILE_RANGE, COPY_SENDFILE, COPY_READ_WRITE, COPY_URING };
+const char* const COPY_METHOD_NAMES[] = {"reflink", "copy_file_range", "sendfile", "read/write", "io_uring"};
+#define COPY_BUFFER_SIZE (1 << 20)
+#define COPY_CALL_MAX (1 << 30) // bytes asked of the kernel in one call
+#define COPY_THREADS_MAX (64)
+
+/**
+* An error that only means the kernel can't copy this way between these two files
+*/
+bool _isCopyUnsupported(int error) {
+	return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP;
+}
+
+/**
+* Copies up to @param count bytes at @param offset through a user space buffer
+* @return the number of bytes copied (0 at the end of the input), -1 on error with errno set
+*/
+ssize_t _copyBuffered(int in_fd, int out_fd, off_t offset, size_t count, vector<char>& buf) {
+	if (buf.empty()) {
+		buf.resize(COPY_BUFFER_SIZE);
+	}
+	ssize_t count_read = pread(in_fd, buf.data(), min(count, buf.size()), offset);
+	if (count_read <= 0) {
+		return count_read;
+	}
+	ssize_t num_written = 0;
+	while (num_written < count_read) {
+		ssize_t write_count = pwrite(out_fd, buf.data() + num_written, count_read - num_written, offset + num_written);
+		if (write_count == -1) {
+			return -1;
+		}
+		num_written += write_count;
+	}
+	return count_read;
+}
+
+/**
+* Copies @param length bytes at @param offset of in_fd to the same offset of out_fd, less if the input ends first.
+* Starts with @param method and moves on to the next one when the kernel can't copy that way, leaving it
+* set to the method that did the copy. sendfile is skipped when other threads @param share_fds, since it
+* writes at the file position of the output
+* @return the number of bytes copied, -1 on error
+*/
+off_t _copyRange(int in_fd, int out_fd, off_t offset, off_t length, CopyMethod& method, bool share_fds = false) {
+	if (method == COPY_REFLINK) {
+		method = COPY_FILE_RANGE;
+	}
+	vector<char> buf;
+	off_t copied = 0;
+	while (copied < length) {
+		size_t count = (size_t) min(length - copied, (off_t) COPY_CALL_MAX);
+		off_t in_offset = offset + copied;
+		off_t out_offset = offset + copied;
+		ssize_t result;
+		if (method == COPY_FILE_RANGE) {
+			result = copy_file_range(in_fd, &in_offset, out_fd, &out_offset, count, 0);
+		} else if (method == COPY_SENDFILE) {
+			// sendfile writes at the file position of the output
+			result = lseek(out_fd, out_offset, SEEK_SET) == -1 ? -1 : sendfile(out_fd, in_fd, &in_offset, count);
+		} else {
+			result = _copyBuffered(in_fd, out_fd, in_offset, count, buf);
+		}
+		if (result == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (method != COPY_READ_WRITE && _isCopyUnsupported(errno)) {
+				method = (share_fds && method == COPY_FILE_RANGE) ? COPY_READ_WRITE : (CopyMethod) (method + 1);
+				continue;
+			}
+			string error = string("smash error: ") + COPY_METHOD_NAMES[method] + " failed";
+			_perror(error.c_str());
+			return -1;
+		} else if (result == 0) {
+			break;
+		}
+		copied += result;
 	}
+	return copied;
+}
+
+#define UPDATE_BLOCK_SIZE (64 * 1024) // the unit cp --update-blocks compares and rewrites
 
-	const string input{args[1]};
-	remove(args[2]);
-	const string output{args[2]};
+/**
+* Makes the @param length bytes at @param offset of out_fd the same as in in_fd, reading both and writing only
+* the blocks that differ. Both files are local, so comparing the blocks themselves costs no more reads than
+* hashing them would, and memcmp is faster than any hash
+* @return the number of bytes compared (less if the input ends first), -1 on error
+*/
+off_t _updateRange(int in_fd, int out_fd, off_t offset, off_t length, off_t& written) {
+	vector<char> in_buf(COPY_BUFFER_SIZE);
+	vector<char> out_buf(COPY_BUFFER_SIZE);
+	off_t compared = 0;
+	while (compared < length) {
+		size_t count = (size_t) min(length - compared, (off_t) in_buf.size());
+		ssize_t count_read = pread(in_fd, in_buf.data(), count, offset + compared);
+		if (count_read == -1) {
+			_perror("smash error: read failed");
+			return -1;
+		} else if (count_read == 0) {
+			break;
+		}
+		// past its old end the output reads as zeros or not at all, and that block gets written
+		ssize_t out_read = pread(out_fd, out_buf.data(), count_read, offset + compared);
+		if (out_read == -1) {
+			_perror("smash error: read failed");
+			return -1;
+		}
+		for (ssize_t block = 0; block < count_read; block += UPDATE_BLOCK_SIZE) {
+			size_t block_size = (size_t) min((ssize_t) UPDATE_BLOCK_SIZE, count_read - block);
+			if (block + (ssize_t) block_size <= out_read && memcmp(in_buf.data() + block, out_buf.data() + block, block_size) == 0) {
+				continue;
+			}
+			size_t num_written = 0;
+			while (num_written < block_size) {
+				ssize_t write_count = pwrite(out_fd, in_buf.data() + block + num_written, block_size - num_written,
+				                             offset + compared + block + num_written);
+				if (write_count == -1) {
+					_perror("smash error: write failed");
+					return -1;
+				}
+				num_written += write_count;
+			}
+			written += block_size;
+		}
+		compared += count_read;
+	}
+	return compared;
+}
 
-	// creating a buffer vector with 1024 byte allocated
-	vector<char> buf(1024);
+/**
+* Finds the data extents (offset, length) of the first @param size bytes of fd, everything else being holes.
+* A filesystem without SEEK_DATA has the whole file as a single extent
+*/
+vector<pair<off_t, off_t>> _dataExtents(int fd, off_t size) {
+	vector<pair<off_t, off_t>> extents;
+	off_t data = 0;
+	while (data < size) {
+		data = lseek(fd, data, SEEK_DATA);
+		if (data == -1 && errno == ENXIO) {
+			// nothing but a hole up to the end
+			break;
+		}
+		off_t hole = data == -1 ? -1 : lseek(fd, data, SEEK_HOLE);
+		if (hole == -1) {
+			extents.assign(1, make_pair((off_t) 0, size));
+			break;
+		}
+		hole = min(hole, size);
+		if (data < hole) {
+			extents.push_back(make_pair(data, hole - data));
+		}
+		data = hole;
+	}
+	return extents;
+}
+
+/**
+* The state the threads of a copy share, each thread takes the next chunk until none is left
+*/
+struct ChunkedCopy {
+	int in_fd;
+	int out_fd;
+	vector<pair<off_t, off_t>> chunks;
+	bool share_fds;
+	bool update_blocks; // compare with the output and write only what differs
+	atomic<size_t> next_chunk;
+	atomic<off_t> written;
+	atomic<off_t> copied;
+	atomic<off_t> end; // where the input ended, if it got shorter while it was copied
+	CopyMethod first_method;
+	atomic<int> method; // the slowest method any thread had to fall back to
+	atomic<bool> failed;
+	WorkerErrors errors; // of the threads other than the calling one
+};
+
+void* _copyChunks(void* arg) {
+	auto* copy = (ChunkedCopy*) arg;
+	CopyMethod method = copy->first_method;
+	while (!copy->failed) {
+		size_t chunk = copy->next_chunk++;
+		if (chunk >= copy->chunks.size()) {
+			break;
+		}
+		off_t offset = copy->chunks[chunk].first;
+		off_t length = copy->chunks[chunk].second;
+		off_t copied;
+		if (copy->update_blocks) {
+			off_t written = 0;
+			copied = _updateRange(copy->in_fd, copy->out_fd, offset, length, written);
+			copy->written += written;
+		} else {
+			copied = _copyRange(copy->in_fd, copy->out_fd, offset, length, method, copy->share_fds);
+		}
+		if (copied == -1) {
+			copy->failed = true;
+			break;
+		}
+		copy->copied += copied;
+		off_t end = copy->end;
+		while (copied < length && offset + copied < end && !copy->end.compare_exchange_weak(end, offset + copied)) {}
+	}
+	int slowest = copy->method;
+	while (slowest < method && !copy->method.compare_exchange_weak(slowest, method)) {}
+	return nullptr;
+}
+
+void* _copyChunksThread(void* arg) {
+	worker_errors = &((ChunkedCopy*) arg)->errors;
+	return _copyChunks(arg);
+}
+
+/**
+* Copies the @param extents of the first @param size bytes of in_fd, leaving holes between them, with
+* up to @param threads_num threads (the calling one included, left set to the number used) @param chunk_size
+* bytes at a time, starting with @param method. The output is sized upfront, so the threads can write anywhere
+* in it and the holes stay holes. With @param written set, the output already holds an older copy: the chunks
+* are compared with it and only the blocks that differ are written, their size is added to *written
+* @return the number of bytes copied, -1 on error
+*/
+off_t _copyExtents(int in_fd, int out_fd, off_t size, const vector<pair<off_t, off_t>>& extents,
+                   int& threads_num, off_t chunk_size, CopyMethod& method, off_t* written = nullptr) {
+	if (method == COPY_REFLINK) {
+		method = COPY_FILE_RANGE;
+	}
+	ChunkedCopy copy;
+	off_t data_size = 0;
+	for (auto& extent : extents) {
+		data_size += extent.second;
+		for (off_t offset = 0; offset < extent.second; offset += chunk_size) {
+			copy.chunks.push_back(make_pair(extent.first + offset, min(chunk_size, extent.second - offset)));
+		}
+	}
+	// reserving the blocks keeps the file from fragmenting, but would fill in the holes
+	if ((data_size < size || fallocate(out_fd, 0, 0, size) == -1) && ftruncate(out_fd, size) == -1) {
+		_perror("smash error: ftruncate failed");
+		return -1;
+	}
+	threads_num = (int) max((size_t) 1, min((size_t) threads_num, copy.chunks.size()));
+	copy.in_fd = in_fd;
+	copy.out_fd = out_fd;
+	copy.share_fds = threads_num > 1;
+	copy.update_blocks = written != nullptr;
+	copy.written = 0;
+	copy.next_chunk = 0;
+	copy.copied = 0;
+	copy.end = size;
+	copy.first_method = method;
+	copy.method = method;
+	copy.failed = false;
+
+	vector<pthread_t> threads;
+	for (int i = 1; i < threads_num; ++i) {
+		pthread_t thread;
+		// with fewer threads the copy is slower, not wrong
+		if (pthread_create(&thread, nullptr, _copyChunksThread, &copy) == 0) {
+			threads.push_back(thread);
+		}
+	}
+	_copyChunks(&copy);
+	for (pthread_t thread : threads) {
+		pthread_join(thread, nullptr);
+	}
+	copy.errors.report();
+	method = (CopyMethod) copy.method.load();
+	if (written != nullptr) {
+		*written += copy.written;
+	}
+	if (copy.failed) {
+		return -1;
+	}
+	if (copy.end < size && ftruncate(out_fd, copy.end) == -1) {
+		_perror("smash error: ftruncate failed");
+		return -1;
+	}
+	return copy.copied;
+}
+
+#define URING_SLOTS (16) // reads, each linked to its write, in flight at once
+#define URING_BLOCK_SIZE (1 << 20)
+#define URING_ALIGNMENT (4096) // O_DIRECT wants aligned buffers, offsets and lengths
+
+/**
+* An io_uring set up with raw syscalls: its mapped rings and a buffer for each slot
+*/
+struct Uring {
+	int fd;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	io_uring_cqe* cqes;
+	unsigned to_submit;
+	char* buffers;
+	bool fixed_buffers; // registered with the kernel, so it doesn't map them for every request
+};
+
+void _uringRelease(Uring& ring) {
+	if (ring.sqes != MAP_FAILED) {
+		munmap(ring.sqes, ring.sqes_size);
+	}
+	if (ring.cq_ring != MAP_FAILED && ring.cq_ring != ring.sq_ring) {
+		munmap(ring.cq_ring, ring.cq_ring_size);
+	}
+	if (ring.sq_ring != MAP_FAILED) {
+		munmap(ring.sq_ring, ring.sq_ring_size);
+	}
+	if (ring.fd != -1) {
+		close(ring.fd);
+	}
+	free(ring.buffers);
+}
+
+/**
+* Sets up a ring for URING_SLOTS read/write pairs and their buffers
+* @return false (with errno set) if the kernel doesn't allow io_uring here
+*/
+bool _uringSetup(Uring& ring) {
+	ring.sq_ring = ring.cq_ring = ring.sqes = (io_uring_sqe*) MAP_FAILED;
+	ring.buffers = nullptr;
+	ring.to_submit = 0;
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring.fd = (int) syscall(__NR_io_uring_setup, URING_SLOTS * 2, &params);
+	if (ring.fd == -1) {
+		return false;
+	}
+
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.sq_ring_size = ring.cq_ring_size = max(ring.sq_ring_size, ring.cq_ring_size);
+	}
+	ring.sq_ring = mmap(nullptr, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                    ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring != MAP_FAILED && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring.cq_ring = ring.sq_ring;
+	} else if (ring.sq_ring != MAP_FAILED) {
+		ring.cq_ring = mmap(nullptr, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                    ring.fd, IORING_OFF_CQ_RING);
+	}
+	ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	if (ring.cq_ring != MAP_FAILED) {
+		ring.sqes = (io_uring_sqe*) mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                                 ring.fd, IORING_OFF_SQES);
+	}
+	if (ring.sqes == MAP_FAILED || posix_memalign((void**) &ring.buffers, URING_ALIGNMENT,
+	                                               (size_t) URING_SLOTS * URING_BLOCK_SIZE) != 0) {
+		int error = ring.sqes == MAP_FAILED ? errno : ENOMEM;
+		_uringRelease(ring);
+		errno = error;
+		return false;
+	}
+
+	char* sq = (char*) ring.sq_ring;
+	char* cq = (char*) ring.cq_ring;
+	ring.sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq + params.sq_off.array);
+	ring.cq_head = (unsigned*) (cq + params.cq_off.head);
+	ring.cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	ring.cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	// pinning the buffers counts against RLIMIT_MEMLOCK, without it every request maps its buffer
+	iovec iovecs[URING_SLOTS];
+	for (int i = 0; i < URING_SLOTS; ++i) {
+		iovecs[i].iov_base = ring.buffers + (size_t) i * URING_BLOCK_SIZE;
+		iovecs[i].iov_len = URING_BLOCK_SIZE;
+	}
+	ring.fixed_buffers = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iovecs, URING_SLOTS) == 0;
+	return true;
+}
+
+/**
+* Queues a read or a write of slot @param slot, the request is tagged with the slot and the kind of request
+*/
+void _uringQueue(Uring& ring, bool is_write, int fd, unsigned slot, size_t buf_offset, size_t length,
+                 off_t offset, bool link) {
+	unsigned tail = *ring.sq_tail;
+	unsigned index = tail & *ring.sq_mask;
+	io_uring_sqe* sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring.fixed_buffers) {
+		sqe->opcode = is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->buf_index = (__u16) slot;
+	} else {
+		sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+	}
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) (ring.buffers + (size_t) slot * URING_BLOCK_SIZE + buf_offset);
+	sqe->len = (unsigned) length;
+	sqe->off = (__u64) offset;
+	// the write only starts once the read has filled the whole buffer
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = slot * 2 + (is_write ? 1 : 0);
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+}
+
+/**
+* The part of the file a slot is copying, and how far it got
+*/
+struct UringSlot {
+	off_t offset;
+	size_t length;
+	ssize_t count_read; // -1 until the read completes
+	size_t num_written;
+	int pending; // requests in flight
+};
+
+/**
+* Copies the first @param size bytes of in_fd with up to URING_SLOTS reads in flight, each linked to the
+* write of the same buffer, so a block is written as soon as it's read without smash waking up in between.
+* With @param direct both files are accessed with O_DIRECT (when the filesystem allows it), bypassing the
+* page cache; writes are then whole blocks and the output is truncated to size at the end
+* @return the number of bytes copied, -1 on error
+*/
+off_t _copyUringRing(Uring& ring, int in_fd, int out_fd, off_t size, bool direct) {
+	if (direct && (fcntl(in_fd, F_SETFL, fcntl(in_fd, F_GETFL) | O_DIRECT) == -1 ||
+	               fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT) == -1)) {
+		direct = false;
+	}
+	UringSlot slots[URING_SLOTS];
+	off_t next_offset = 0;
+	off_t end = size; // moves back if the input turns out shorter
+	off_t copied = 0;
+	int error = 0;
+	int busy = 0;
+
+	auto startSlot = [&](unsigned slot) {
+		UringSlot& s = slots[slot];
+		s.offset = next_offset;
+		s.length = (size_t) min((off_t) URING_BLOCK_SIZE, end - next_offset);
+		if (direct) {
+			s.length = (s.length + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT;
+		}
+		s.count_read = -1;
+		s.num_written = 0;
+		s.pending = 2;
+		next_offset += URING_BLOCK_SIZE;
+		_uringQueue(ring, false, in_fd, slot, 0, s.length, s.offset, true);
+		_uringQueue(ring, true, out_fd, slot, 0, s.length, s.offset, false);
+		busy++;
+	};
+	for (unsigned slot = 0; slot < URING_SLOTS && next_offset < end; ++slot) {
+		startSlot(slot);
+	}
+
+	while (busy > 0) {
+		int submitted = (int) syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		if (submitted == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// nothing can be reaped anymore, so the buffers may still be in use: keep them
+			_perror("smash error: io_uring_enter failed");
+			ring.buffers = nullptr;
+			return -1;
+		}
+		ring.to_submit -= submitted;
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; ++head) {
+			io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			unsigned slot = (unsigned) (cqe->user_data / 2);
+			bool is_write = cqe->user_data % 2 == 1;
+			UringSlot& s = slots[slot];
+			s.pending--;
+			// a short read cancels the write linked to it, what was read is written below
+			if (cqe->res < 0 && cqe->res != -ECANCELED && error == 0) {
+				error = -cqe->res;
+			} else if (cqe->res >= 0 && is_write) {
+				s.num_written += cqe->res;
+			} else if (cqe->res >= 0) {
+				s.count_read = cqe->res;
+			}
+			if (s.pending > 0) {
+				continue;
+			}
+
+			size_t count_read = s.count_read < 0 ? 0 : (size_t) s.count_read;
+			// a short read is the end of the input only once it reaches size (or reads nothing at all)
+			bool is_short = count_read < s.length;
+			bool at_end = count_read == 0 || s.offset + (off_t) count_read >= size;
+			size_t to_write = count_read;
+			if (is_short && !at_end) {
+				// keep what was read up to an O_DIRECT block boundary, the rest is read again
+				to_write = direct ? count_read / URING_ALIGNMENT * URING_ALIGNMENT : count_read;
+			} else if (direct) {
+				to_write = (to_write + URING_ALIGNMENT - 1) / URING_ALIGNMENT * URING_ALIGNMENT;
+			}
+			if (error != 0) {
+				busy--;
+			} else if (s.num_written < to_write) {
+				_uringQueue(ring, true, out_fd, slot, s.num_written, to_write - s.num_written,
+				            s.offset + s.num_written, false);
+				s.pending = 1;
+			} else if (is_short && !at_end) {
+				// read less than asked for before the end, the rest of the block is read again
+				copied += to_write;
+				s.offset += to_write;
+				s.length -= to_write;
+				s.count_read = -1;
+				s.num_written = 0;
+				s.pending = 2;
+				_uringQueue(ring, false, in_fd, slot, 0, s.length, s.offset, true);
+				_uringQueue(ring, true, out_fd, slot, 0, s.length, s.offset, false);
+			} else {
+				copied += s.count_read;
+				if ((size_t) s.count_read < s.length) {
+					end = min(end, s.offset + s.count_read);
+				}
+				busy--;
+				if (next_offset < end) {
+					startSlot(slot);
+				}
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	if (error != 0) {
+		errno = error;
+		_perror("smash error: io_uring failed");
+		return -1;
+	}
+	// the input was shorter than its size, or O_DIRECT padded the last block
+	if ((copied < size || direct) && ftruncate(out_fd, copied) == -1) {
+		_perror("smash error: ftruncate failed");
+		return -1;
+	}
+	return copied;
+}
+
+/**
+* Copies the first @param size bytes of in_fd with io_uring, or with _copyRange if io_uring can't be used.
+* @param method is left set to the method that did the copy
+* @return the number of bytes copied, -1 on error
+*/
+off_t _copyUring(int in_fd, int out_fd, off_t size, bool direct, CopyMethod& method) {
+	Uring ring;
+	if (!_uringSetup(ring)) {
+		method = COPY_FILE_RANGE;
+		return _copyRange(in_fd, out_fd, 0, numeric_limits<off_t>::max(), method);
+	}
+	method = COPY_URING;
+	off_t copied = _copyUringRing(ring, in_fd, out_fd, size, direct);
+	_uringRelease(ring);
+	return copied;
+}
+
+/**
+* Parses a size in bytes, with an optional K, M or G suffix
+* @return the size, or -1 if it isn't a positive one
+*/
+off_t _parseSize(const string& str) {
+	char* end = nullptr;
+	errno = 0;
+	long long size = strtoll(str.c_str(), &end, 10);
+	if (errno != 0 || end == str.c_str() || size <= 0) {
+		return -1;
+	}
+	string suffix(end);
+	if (suffix == "K") {
+		size <<= 10;
+	} else if (suffix == "M") {
+		size <<= 20;
+	} else if (suffix == "G") {
+		size <<= 30;
+	} else if (!suffix.empty()) {
+		return -1;
+	}
+	return size;
+}
+
+/**
+* What a copy did, for cp -v
+*/
+struct CopyReport {
+	CopyMethod method; // the slowest one used
+	int threads_used;
+	long files_num;
+	off_t copied;
+	off_t holes_size;
+	off_t written; // by cp --update-blocks
+	CopyReport() : method(COPY_REFLINK), threads_used(1), files_num(0), copied(0), holes_size(0), written(0) {}
+};
+
+/**
+* cp --update-blocks of the open file @param input_fd to @param dst (relative to @param dst_dirfd), which is
+* updated in place: skipped if its size and modification time match, otherwise only the blocks that differ are
+* written, and then it gets the input's modification time so that the next update can skip it
+* @return false on error, which was already printed
+*/
+bool _updateFile(int input_fd, const struct stat& input_stat, int dst_dirfd, const char* dst, mode_t mode,
+                 const CopyOptions& options, CopyReport& report) {
+	int output_fd = openat(dst_dirfd, dst, O_RDWR | O_CREAT, mode != 0 ? mode : input_stat.st_mode & 07777);
+	if (output_fd == -1) {
+		_perror("smash error: open failed");
+		if (close(input_fd) == -1) {
+			_perror("smash error: close failed");
+		}
+		return false;
+	}
+	struct stat output_stat;
+	off_t copied = -1;
+	CopyMethod method = COPY_READ_WRITE;
+	int threads_used = 1;
+	if (fstat(output_fd, &output_stat) == -1) {
+		_perror("smash error: fstat failed");
+	} else if (output_stat.st_size == input_stat.st_size && output_stat.st_mtim.tv_sec == input_stat.st_mtim.tv_sec &&
+	           output_stat.st_mtim.tv_nsec == input_stat.st_mtim.tv_nsec) {
+		copied = input_stat.st_size;
+	} else {
+		// the holes of the input may be data in the output, so every byte is compared
+		vector<pair<off_t, off_t>> extents(1, make_pair((off_t) 0, input_stat.st_size));
+		threads_used = options.threads_num;
+		// a longer output is cut here, _copyExtents only ever grows it
+		if (output_stat.st_size > input_stat.st_size && ftruncate(output_fd, input_stat.st_size) == -1) {
+			_perror("smash error: ftruncate failed");
+		} else {
+			copied = _copyExtents(input_fd, output_fd, input_stat.st_size, extents, threads_used, options.chunk_size,
+			                      method, &report.written);
+		}
+		struct timespec times[2] = {input_stat.st_atim, input_stat.st_mtim};
+		if (copied != -1 && futimens(output_fd, times) == -1) {
+			_perror("smash error: futimens failed");
+			copied = -1;
+		}
+	}
+	if (close(input_fd) == -1 || close(output_fd) == -1) {
+		_perror("smash error: close failed");
+	}
+	if (copied == -1) {
+		return false;
+	}
+	report.method = max(report.method, method);
+	report.threads_used = max(report.threads_used, threads_used);
+	report.files_num++;
+	report.copied += copied;
+	return true;
+}
+
+/**
+* Copies the file @param src (relative to @param src_dirfd) to @param dst (relative to @param dst_dirfd),
+* replacing it if it exists. The new file gets @param mode, or the mode of the source if it's 0
+* @return false on error, which was already printed
+*/
+bool _copyFile(int src_dirfd, const char* src, int dst_dirfd, const char* dst, mode_t mode,
+               const CopyOptions& options, CopyReport& report) {
 	// input file descriptor
-	int input_fd = open(input.c_str(), O_RDONLY);
+	int input_fd = openat(src_dirfd, src, O_RDONLY);
 	if (input_fd == -1) {
-		perror("smash error: open failed");
-		return;
+		_perror("smash error: open failed");
+		return false;
+	}
+	struct stat input_stat;
+	if (fstat(input_fd, &input_stat) == -1) {
+		_perror("smash error: fstat failed");
+		close(input_fd);
+		return false;
+	}
+	if (options.update_blocks && S_ISREG(input_stat.st_mode)) {
+		return _updateFile(input_fd, input_stat, dst_dirfd, dst, mode, options, report);
 	}
+	unlinkat(dst_dirfd, dst, 0);
 	// output file descriptor
-	int output_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0664);
+	int output_fd = openat(dst_dirfd, dst, O_WRONLY | O_CREAT | O_EXCL, mode != 0 ? mode : input_stat.st_mode & 07777);
 	if (output_fd == -1) {
-		perror("smash error: open failed");
+		_perror("smash error: open failed");
 		if (close(input_fd) == -1) {
-			perror("smash error: close failed");
+			_perror("smash error: close failed");
+		}
+		return false;
+	}
+
+	off_t copied = -1;
+	CopyMethod method = options.engine == "rw" ? COPY_READ_WRITE : options.engine == "range" ? COPY_FILE_RANGE : COPY_REFLINK;
+	int threads_used = 1;
+	if (S_ISREG(input_stat.st_mode) && input_stat.st_size > 0) {
+		// sharing the extents (btrfs, xfs) copies no data at all
+		if (method == COPY_REFLINK && ioctl(output_fd, FICLONE, input_fd) == 0) {
+			copied = input_stat.st_size;
+		} else if (options.engine == "uring") {
+			copied = _copyUring(input_fd, output_fd, input_stat.st_size, options.direct, method);
+		} else {
+			// only the data is copied, so sparse files (disk images, core dumps) stay sparse
+			vector<pair<off_t, off_t>> extents = _dataExtents(input_fd, input_stat.st_size);
+			report.holes_size += input_stat.st_size;
+			for (auto& extent : extents) {
+				report.holes_size -= extent.second;
+			}
+			threads_used = options.threads_num;
+			copied = _copyExtents(input_fd, output_fd, input_stat.st_size, extents, threads_used, options.chunk_size, method);
+		}
+	} else {
+		// pipes, devices and procfs files (size 0) have to be read to find their end
+		method = COPY_READ_WRITE;
+		copied = _copyRange(input_fd, output_fd, 0, numeric_limits<off_t>::max(), method);
+	}
+	if (close(input_fd) == -1 || close(output_fd) == -1) {
+		_perror("smash error: close failed");
+	}
+	if (copied == -1) {
+		return false;
+	}
+	report.method = max(report.method, method);
+	report.threads_used = max(report.threads_used, threads_used);
+	report.files_num++;
+	report.copied += copied;
+	return true;
+}
+
+/**
+* A directory fd shared by the walker tasks under it, closed by the last one. A destination directory created
+* writable to fill it in gets its own mode back then, its entries are all in by that time
+*/
+struct DirFd {
+	int fd;
+	bool restore_mode;
+	mode_t mode;
+	explicit DirFd(int fd, bool restore_mode = false, mode_t mode = 0) : fd(fd), restore_mode(restore_mode), mode(mode) {}
+	~DirFd() {
+		if (fd >= 0) {
+			if (restore_mode && fchmod(fd, mode) == -1) {
+				_perror("smash error: chmod failed");
+			}
+			close(fd);
 		}
-		return;
 	}
+};
 
+/**
+* An entry to copy, @param name in src_dir to the same name in dst_dir
+*/
+struct TreeTask {
+	shared_ptr<DirFd> src_dir;
+	shared_ptr<DirFd> dst_dir;
+	string name;
+	unsigned char type; // a DT_* value from getdents64, DT_UNKNOWN if it has to be fstatat'ed
+};
+
+/**
+* The state the threads of a tree copy share. Each thread has a deque of tasks: it pushes the entries of the
+* directories it reads to the back of its own and pops from there (depth first, the fds it needs are hot),
+* and steals from the front of another thread's deque (a whole subtree, so steals are rare) when it runs out
+*/
+struct TreeCopy {
+	CopyOptions options;
+	vector<deque<TreeTask>> queues;
+	vector<pthread_mutex_t> queue_mutexes;
+	atomic<long> queued; // tasks in the deques
+	atomic<long> pending; // tasks queued or running, the copy is done at 0
+	pthread_mutex_t idle_mutex;
+	pthread_cond_t idle_cond;
+	pthread_mutex_t report_mutex;
+	CopyReport report;
+	dev_t dst_dev; // the destination root, which mustn't be copied into itself
+	ino_t dst_ino;
+	atomic<bool> failed;
+	WorkerErrors errors; // of the threads other than the calling one
+};
+
+struct TreeWorker {
+	TreeCopy* copy;
+	size_t id;
+};
+
+void _pushTreeTask(TreeCopy& copy, size_t worker, TreeTask task) {
+	copy.pending++;
+	pthread_mutex_lock(&copy.queue_mutexes[worker]);
+	copy.queues[worker].push_back(move(task));
+	pthread_mutex_unlock(&copy.queue_mutexes[worker]);
+	pthread_mutex_lock(&copy.idle_mutex);
+	copy.queued++;
+	pthread_cond_signal(&copy.idle_cond);
+	pthread_mutex_unlock(&copy.idle_mutex);
+}
+
+bool _popTreeTask(TreeCopy& copy, size_t worker, TreeTask& task) {
+	for (size_t i = 0; i < copy.queues.size(); ++i) {
+		size_t victim = (worker + i) % copy.queues.size();
+		pthread_mutex_lock(&copy.queue_mutexes[victim]);
+		deque<TreeTask>& queue = copy.queues[victim];
+		bool found = !queue.empty();
+		if (found && victim == worker) {
+			task = move(queue.back());
+			queue.pop_back();
+		} else if (found) {
+			task = move(queue.front());
+			queue.pop_front();
+		}
+		pthread_mutex_unlock(&copy.queue_mutexes[victim]);
+		if (found) {
+			copy.queued--;
+			return true;
+		}
+	}
+	return false;
+}
+
+// the record getdents64 fills in, glibc only wraps it since 2.30
+struct LinuxDirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+#define DIRENTS_BUFFER_SIZE (64 * 1024)
+
+/**
+* Copies the directory of @param task, queueing its entries for the workers
+*/
+bool _copyTreeDir(TreeCopy& copy, size_t worker, const TreeTask& task, const struct stat& dir_stat) {
+	if (dir_stat.st_dev == copy.dst_dev && dir_stat.st_ino == copy.dst_ino) {
+		_printError("cp: cannot copy a directory into itself");
+		return false;
+	}
+	int src_fd = openat(task.src_dir->fd, task.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (src_fd == -1) {
+		_perror("smash error: open failed");
+		return false;
+	}
+	auto src_dir = make_shared<DirFd>(src_fd);
+	// writable by us until the files are in, like cp. A directory that was already there is left as it is
+	mode_t mode = dir_stat.st_mode & 07777;
+	bool created = mkdirat(task.dst_dir->fd, task.name.c_str(), mode | S_IRWXU) == 0;
+	if (!created && errno != EEXIST) {
+		_perror("smash error: mkdir failed");
+		return false;
+	}
+	int dst_fd = openat(task.dst_dir->fd, task.name.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dst_fd == -1) {
+		_perror("smash error: open failed");
+		return false;
+	}
+	auto dst_dir = make_shared<DirFd>(dst_fd, created && (mode & S_IRWXU) != S_IRWXU, mode);
+
+	vector<char> buf(DIRENTS_BUFFER_SIZE);
 	while (true) {
-		ssize_t count = read(input_fd, buf.data(), buf.size());
-		if (count == 0) {
+		long count = syscall(SYS_getdents64, src_fd, buf.data(), buf.size());
+		if (count == -1) {
+			_perror("smash error: getdents64 failed");
+			return false;
+		} else if (count == 0) {
 			break;
-		} else if (count == -1) {
-			perror("smash error: read failed");
-			if (close(input_fd) == -1 || close(output_fd) == -1) {
-				perror("smash error: close failed");
+		}
+		for (long pos = 0; pos < count;) {
+			auto* entry = (LinuxDirent64*) (buf.data() + pos);
+			pos += entry->d_reclen;
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
 			}
-			return;
+			_pushTreeTask(copy, worker, TreeTask{src_dir, dst_dir, entry->d_name, entry->d_type});
 		}
-		ssize_t num_written = 0;
-		ssize_t num_to_write = count;
-		while(num_written < num_to_write){
-			ssize_t write_count = write(output_fd, buf.data() + num_written, count - num_written);
-			if (write_count == -1) {
-				perror("smash error: write failed");
-				if (close(input_fd) == -1 || close(output_fd) == -1) {
-					perror("smash error: close failed");
-				}
-				return;
-			} else {
-				num_written += write_count;
+	}
+	return true;
+}
+
+/**
+* Copies one entry of the tree: a file, a symbolic link, a special file, or a directory whose entries are queued
+*/
+bool _copyTreeEntry(TreeCopy& copy, size_t worker, const TreeTask& task) {
+	struct stat entry_stat;
+	unsigned char type = task.type;
+	if (type == DT_UNKNOWN || type == DT_DIR) {
+		if (fstatat(task.src_dir->fd, task.name.c_str(), &entry_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+			_perror("smash error: fstatat failed");
+			return false;
+		}
+		type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : S_ISREG(entry_stat.st_mode) ? DT_REG :
+		       S_ISLNK(entry_stat.st_mode) ? DT_LNK : DT_UNKNOWN;
+	}
+	const char* name = task.name.c_str();
+	if (type == DT_DIR) {
+		return _copyTreeDir(copy, worker, task, entry_stat);
+	} else if (type == DT_REG) {
+		CopyReport report;
+		if (!_copyFile(task.src_dir->fd, name, task.dst_dir->fd, name, 0, copy.options, report)) {
+			return false;
+		}
+		pthread_mutex_lock(&copy.report_mutex);
+		copy.report.method = max(copy.report.method, report.method);
+		copy.report.files_num += report.files_num;
+		copy.report.copied += report.copied;
+		copy.report.holes_size += report.holes_size;
+		copy.report.written += report.written;
+		pthread_mutex_unlock(&copy.report_mutex);
+		return true;
+	}
+
+	unlinkat(task.dst_dir->fd, name, 0);
+	if (type == DT_LNK) {
+		char target[PATH_MAX];
+		ssize_t length = readlinkat(task.src_dir->fd, name, target, sizeof(target) - 1);
+		if (length == -1) {
+			_perror("smash error: readlink failed");
+			return false;
+		}
+		target[length] = '\0';
+		if (symlinkat(target, task.dst_dir->fd, name) == -1) {
+			_perror("smash error: symlink failed");
+			return false;
+		}
+		return true;
+	}
+	// fifos, sockets and devices are recreated, not read
+	if (task.type != DT_UNKNOWN && fstatat(task.src_dir->fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+		_perror("smash error: fstatat failed");
+		return false;
+	}
+	if (mknodat(task.dst_dir->fd, name, entry_stat.st_mode, entry_stat.st_rdev) == -1) {
+		_perror("smash error: mknod failed");
+		return false;
+	}
+	return true;
+}
+
+void* _copyTreeWorker(void* arg) {
+	auto* worker = (TreeWorker*) arg;
+	TreeCopy& copy = *worker->copy;
+	// worker 0 is the thread that started the copy
+	if (worker->id != 0) {
+		worker_errors = &copy.errors;
+	}
+	while (true) {
+		TreeTask task;
+		if (_popTreeTask(copy, worker->id, task)) {
+			if (!_copyTreeEntry(copy, worker->id, task)) {
+				copy.failed = true;
 			}
+			// the fds of the directories above are closed once no task refers to them
+			task = TreeTask();
+			if (--copy.pending == 0) {
+				pthread_mutex_lock(&copy.idle_mutex);
+				pthread_cond_broadcast(&copy.idle_cond);
+				pthread_mutex_unlock(&copy.idle_mutex);
+			}
+			continue;
+		}
+		pthread_mutex_lock(&copy.idle_mutex);
+		while (copy.pending > 0 && copy.queued == 0) {
+			pthread_cond_wait(&copy.idle_cond, &copy.idle_mutex);
+		}
+		pthread_mutex_unlock(&copy.idle_mutex);
+		if (copy.pending == 0) {
+			return nullptr;
 		}
 	}
-	if (close(input_fd) == -1 || close(output_fd) == -1) {
-		perror("smash error: close failed");
+}
+
+/**
+* Tells whether @param dst, which may not exist yet, is the directory @param src or somewhere under it.
+* The part of dst that exists is resolved with realpath, the rest can't hold any symbolic links yet
+*/
+bool _isInsideDir(const string& src, const string& dst) {
+	char resolved[PATH_MAX];
+	if (realpath(src.c_str(), resolved) == nullptr) {
+		return false;
+	}
+	string src_path(resolved);
+	string existing = dst;
+	string rest;
+	while (realpath(existing.c_str(), resolved) == nullptr) {
+		size_t slash = existing.find_last_of('/', existing.find_last_not_of('/'));
+		if (slash == string::npos) {
+			existing = ".";
+			rest = dst;
+			if (realpath(existing.c_str(), resolved) == nullptr) {
+				return false;
+			}
+			break;
+		}
+		rest = existing.substr(slash + 1) + (rest.empty() ? "" : "/" + rest);
+		existing = slash == 0 ? "/" : existing.substr(0, slash);
+	}
+	string dst_path = string(resolved) + (rest.empty() ? "" : "/" + rest);
+	if (src_path == "/") {
+		return true;
+	}
+	return dst_path == src_path || dst_path.compare(0, src_path.size() + 1, src_path + "/") == 0;
+}
+
+/**
+* Copies the directory @param src to @param dst recursively. Directories are read with getdents64 and every
+* entry is opened relative to its directory's fd, by a pool of threads that copy the files as they're found
+* @return false if anything couldn't be copied
+*/
+bool _copyTree(const string& src, const string& dst, const CopyOptions& options, CopyReport& report) {
+	struct stat src_stat;
+	if (stat(src.c_str(), &src_stat) == -1) {
+		_perror("smash error: stat failed");
+		return false;
+	}
+	// checked before anything is created, the walk would otherwise copy part of the tree first
+	if (_isInsideDir(src, dst)) {
+		_printError("cp: cannot copy a directory into itself");
+		return false;
+	}
+	mode_t mode = src_stat.st_mode & 07777;
+	bool created = mkdir(dst.c_str(), mode | S_IRWXU) == 0;
+	if (!created && errno != EEXIST) {
+		_perror("smash error: mkdir failed");
+		return false;
+	}
+	struct stat dst_stat;
+	if (stat(dst.c_str(), &dst_stat) == -1) {
+		_perror("smash error: stat failed");
+		return false;
+	}
+	int src_fd = open(src.c_str(), O_RDONLY | O_DIRECTORY);
+	if (src_fd == -1) {
+		_perror("smash error: open failed");
+		return false;
+	}
+	int dst_fd = open(dst.c_str(), O_RDONLY | O_DIRECTORY);
+	if (dst_fd == -1) {
+		_perror("smash error: open failed");
+		close(src_fd);
+		return false;
+	}
+
+	TreeCopy copy;
+	copy.options = options;
+	// the files are the unit of parallelism here
+	copy.options.threads_num = 1;
+	size_t threads_num = (size_t) options.threads_num;
+	copy.queues.resize(threads_num);
+	copy.queue_mutexes.resize(threads_num);
+	for (pthread_mutex_t& mutex : copy.queue_mutexes) {
+		pthread_mutex_init(&mutex, nullptr);
+	}
+	pthread_mutex_init(&copy.idle_mutex, nullptr);
+	pthread_cond_init(&copy.idle_cond, nullptr);
+	pthread_mutex_init(&copy.report_mutex, nullptr);
+	copy.queued = 0;
+	copy.pending = 0;
+	copy.dst_dev = dst_stat.st_dev;
+	copy.dst_ino = dst_stat.st_ino;
+	copy.failed = false;
+
+	// the root is copied into the destination itself, its entries are the first tasks
+	TreeTask root{make_shared<DirFd>(src_fd), make_shared<DirFd>(dst_fd), ".", DT_DIR};
+	if (!_copyTreeDir(copy, 0, root, src_stat)) {
+		copy.failed = true;
+	}
+	root = TreeTask();
+
+	vector<TreeWorker> workers(threads_num);
+	vector<pthread_t> threads;
+	for (size_t i = 0; i < threads_num; ++i) {
+		workers[i] = TreeWorker{&copy, i};
+	}
+	for (size_t i = 1; i < threads_num; ++i) {
+		pthread_t thread;
+		// with fewer threads the copy is slower, not wrong
+		if (pthread_create(&thread, nullptr, _copyTreeWorker, &workers[i]) == 0) {
+			threads.push_back(thread);
+		}
+	}
+	_copyTreeWorker(&workers[0]);
+	for (pthread_t thread : threads) {
+		pthread_join(thread, nullptr);
+	}
+	copy.errors.report();
+	for (pthread_mutex_t& mutex : copy.queue_mutexes) {
+		pthread_mutex_destroy(&mutex);
+	}
+	pthread_mutex_destroy(&copy.idle_mutex);
+	pthread_cond_destroy(&copy.idle_cond);
+	pthread_mutex_destroy(&copy.report_mutex);
+	// the root is opened again by _copyTreeDir as an existing directory, so its mode is restored here
+	if (created && (mode & S_IRWXU) != S_IRWXU && chmod(dst.c_str(), mode) == -1) {
+		_perror("smash error: chmod failed");
+	}
+
+	report.method = max(report.method, copy.report.method);
+	report.threads_used = max(report.threads_used, (int) threads.size() + 1);
+	report.files_num += copy.report.files_num;
+	report.copied += copy.report.copied;
+	report.holes_size += copy.report.holes_size;
+	report.written += copy.report.written;
+	return !copy.failed;
+}
+
+/**
+* Reads the options out of the arguments, leaving the sources and the destination in paths
+* @return false if an option is unknown or there's nothing to copy
+*/
+bool CopyCommand::parseArgs() {
+	paths.clear();
+	for (int i = 1; i < args_num; ++i) {
+		string arg(args[i]);
+		if (arg == "-v") {
+			verbose = true;
+		} else if (arg == "-r" || arg == "-R") {
+			recursive = true;
+		} else if (arg.compare(0, 10, "--threads=") == 0) {
+			off_t num = _parseSize(arg.substr(10));
+			if (num <= 0 || num > COPY_THREADS_MAX) {
+				return false;
+			}
+			options.threads_num = (int) num;
+		} else if (arg.compare(0, 13, "--chunk-size=") == 0) {
+			options.chunk_size = _parseSize(arg.substr(13));
+			if (options.chunk_size <= 0) {
+				return false;
+			}
+		} else if (arg.compare(0, 9, "--engine=") == 0) {
+			options.engine = arg.substr(9);
+			if (options.engine != "auto" && options.engine != "range" && options.engine != "rw" && options.engine != "uring") {
+				return false;
+			}
+		} else if (arg == "--direct") {
+			options.direct = true;
+		} else if (arg == "--update-blocks") {
+			options.update_blocks = true;
+		} else if (arg.length() > 1 && arg[0] == '-') {
+			return false;
+		} else {
+			paths.push_back(arg);
+		}
+	}
+	return paths.size() >= 2;
+}
+
+string _baseName(const string& path) {
+	size_t end = path.find_last_not_of('/');
+	if (end == string::npos) {
+		return "/";
+	}
+	size_t start = path.find_last_of('/', end);
+	return path.substr(start == string::npos ? 0 : start + 1, end - (start == string::npos ? 0 : start + 1) + 1);
+}
+
+void CopyCommand::execute() {
+	if (!parseArgs()) {
+		_printError("cp: invalid arguments");
+		return;
+	}
+	// cp a b c dir/ copies into the directory, so does cp a dir
+	const string& target = paths.back();
+	struct stat target_stat;
+	bool into_dir = stat(target.c_str(), &target_stat) == 0 && S_ISDIR(target_stat.st_mode);
+	if (paths.size() > 2 && !into_dir) {
+		_printError("cp: invalid arguments");
+		return;
+	}
+
+	for (size_t i = 0; i + 1 < paths.size(); ++i) {
+		const string& input = paths[i];
+		string output = target;
+		if (into_dir) {
+			output += (output.back() == '/' ? "" : "/") + _baseName(input);
+		}
+		auto start = chrono::steady_clock::now();
+		CopyReport report;
+		struct stat input_stat;
+		if (stat(input.c_str(), &input_stat) == 0 && S_ISDIR(input_stat.st_mode)) {
+			if (!recursive) {
+				_printError("cp: -r not specified; omitting directory " + input);
+				continue;
+			}
+			if (!_copyTree(input, output, options, report)) {
+				continue;
+			}
+		} else if (!_copyFile(AT_FDCWD, input.c_str(), AT_FDCWD, output.c_str(), 0664, options, report)) {
+			continue;
+		}
+
+		if (verbose) {
+			double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			ostringstream line;
+			line << fixed << setprecision(1) << COPY_METHOD_NAMES[report.method];
+			if (report.threads_used > 1) {
+				line << ", " << report.threads_used << " threads";
+			}
+			if (report.files_num != 1) {
+				line << ", " << report.files_num << " files";
+			}
+			line << ", " << report.copied << " bytes";
+			if (report.holes_size > 0) {
+				line << " (" << report.holes_size << " bytes of holes skipped)";
+			}
+			line << " in " << secs * 1000 << " ms (" << (secs > 0 ? report.copied / secs / (1 << 20) : 0) << " MB/s)";
+			cout << "smash: cp: " << line.str() << '\n';
+		}
+		if (options.update_blocks) {
+			cout << "smash: cp: " << report.written << " of " << report.copied << " bytes written\n";
+		}
+		cout << "smash: " << input << " was copied to " << output << '\n';
 	}
-	cout << "smash: " << args[1] << " was copied to " << args[2] << endl;
+}
+
+#define BUILTIN_SEEDS_MAX (256) // seeds tried per table size before the table grows
+
+uint32_t BuiltInTable::hash(const string& name, uint32_t seed) {
+	// FNV-1a, the seed folded into the offset basis
+	uint32_t h = 2166136261u ^ seed;
+	for (char c : name) {
+		h ^= (unsigned char) c;
+		h *= 16777619u;
+	}
+	return h ^ (h >> 16);
+}
+
+/**
+* Puts every entry in slots_num slots, hashed with @param seed
+* @return false if two names share a slot
+*/
+bool BuiltInTable::placeAll(size_t slots_num, uint32_t seed) {
+	vector<Entry> new_slots(slots_num);
+	for (const Entry& entry : entries) {
+		Entry& slot = new_slots[hash(entry.name, seed) & (slots_num - 1)];
+		if (slot.factory != nullptr) {
+			return false;
+		}
+		slot = entry;
+	}
+	slots.swap(new_slots);
+	this->seed = seed;
+	return true;
+}
+
+/**
+* Adds (or replaces) the built-in @param name, then finds a collision free table for all of them
+*/
+void BuiltInTable::add(const string& name, CommandFactory factory, bool runs_in_process) {
+	auto it = find_if(entries.begin(), entries.end(), [&name](const Entry& entry) { return entry.name == name; });
+	if (it != entries.end()) {
+		it->factory = factory;
+		it->runs_in_process = runs_in_process;
+	} else {
+		entries.push_back(Entry{name, factory, runs_in_process});
+	}
+	size_t slots_num = 1;
+	while (slots_num < entries.size() * 2) {
+		slots_num *= 2;
+	}
+	for (;; slots_num *= 2) {
+		for (uint32_t new_seed = 0; new_seed < BUILTIN_SEEDS_MAX; ++new_seed) {
+			if (placeAll(slots_num, new_seed)) {
+				return;
+			}
+		}
+	}
+}
+
+/**
+* @return the entry of the built-in @param name, or nullptr if it isn't one
+*/
+const BuiltInTable::Entry* BuiltInTable::find(const string& name) const {
+	const Entry& slot = slots[hash(name, seed) & (slots.size() - 1)];
+	return (slot.factory != nullptr && slot.name == name) ? &slot : nullptr;
 }
 
 SmallShell::SmallShell() {
+	pid = getpid();
 	last_wd = "";
     curr_wd = _getCWD();
 	cmd_history = new CommandsHistory();
 	jobs_list = new JobsList();
+	path_cache = new CommandPathCache();
+
+	registerBuiltIn("pwd", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new GetCurrDirCommand(cmd_line);
+	}, true);
+	registerBuiltIn("cd", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new ChangeDirCommand(cmd_line);
+	});
+	registerBuiltIn("history", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new HistoryCommand(cmd_line, smash.cmd_history);
+	}, true);
+	registerBuiltIn("jobs", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new JobsCommand(cmd_line, smash.jobs_list);
+	}, true);
+	registerBuiltIn("kill", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new KillCommand(cmd_line, smash.jobs_list);
+	});
+	registerBuiltIn("showpid", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new ShowPidCommand(cmd_line);
+	}, true);
+	registerBuiltIn("fg", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new ForegroundCommand(cmd_line, smash.jobs_list);
+	});
+	registerBuiltIn("bg", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new BackgroundCommand(cmd_line, smash.jobs_list);
+	});
+	registerBuiltIn("quit", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new QuitCommand(cmd_line, smash.jobs_list);
+	});
+	registerBuiltIn("cp", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new CopyCommand(cmd_line);
+	});
+	registerBuiltIn("hash", [](const char* cmd_line, SmallShell& smash) -> Command* {
+		return new HashCommand(cmd_line, smash.path_cache);
+	});
+}
+
+/**
+* Makes @param name a built-in, created by @param factory (replacing a built-in of the same name).
+* Set @param runs_in_process for built-ins that only print: as pipeline stages they run inside smash, not forked
+*/
+void SmallShell::registerBuiltIn(const string& name, CommandFactory factory, bool runs_in_process) {
+	builtins.add(name, factory, runs_in_process);
 }
 
 SmallShell::~SmallShell() {
 	delete cmd_history;
 	delete jobs_list;
+	delete path_cache;
 }
 
 /**
 * Creates and returns a pointer to Command class which matches the given command line (cmd_line)
 */
 Command* SmallShell::createCommand(const char* cmd_line, string cmd_s) {
-    if (cmd_s == "pwd") {
-        return new GetCurrDirCommand(cmd_line);
-    } else if (cmd_s == "cd") {
-        return new ChangeDirCommand(cmd_line);
-    } else if (cmd_s == "history") {
-        return new HistoryCommand(cmd_line, cmd_history);
-    } else if (cmd_s == "jobs") {
-        return new JobsCommand(cmd_line, jobs_list);
-    } else if (cmd_s == "kill") {
-        return new KillCommand(cmd_line, jobs_list);
-    } else if (cmd_s == "showpid") {
-        return new ShowPidCommand(cmd_line);
-    } else if (cmd_s == "fg") {
-        return new ForegroundCommand(cmd_line, jobs_list);
-    } else if (cmd_s == "bg") {
-        return new BackgroundCommand(cmd_line, jobs_list);
-    } else if (cmd_s == "quit") {
-        return new QuitCommand(cmd_line, jobs_list);
-    } else if (cmd_s == "cp") {
-        return new CopyCommand(cmd_line);
-    } else {
-        return new ExternalCommand(cmd_line, jobs_list);
+    if (_isPipeCommand(cmd_line)) {
+        return new PipeCommand(cmd_line, jobs_list, path_cache);
+    }
+    const BuiltInTable::Entry* builtin = builtins.find(cmd_s);
+    if (builtin != nullptr) {
+        return builtin->factory(cmd_line, *this);
     }
+    return new ExternalCommand(cmd_line, jobs_list, path_cache);
 }
 
 void SmallShell::executeCommand(const char* cmd_line) {
-    getpid();
-    char* args[COMMAND_MAX_ARGS];
-	_parseCommandLine(cmd_line, args);
-	string cmd_s = args[0];
+	string cmd_s = _firstWord(cmd_line);
+	if (cmd_s.empty()) {
+		return;
+	}
 
-    Command* cmd = createCommand(cmd_line, cmd_s);
+	// owned here, a command is done with once it has run (jobs keep their own copy of the line)
+	unique_ptr<Command> cmd(createCommand(cmd_line, cmd_s));
 	cmd_history->addRecord(cmd_line);
-    cmd->execute();
+	auto* builtin = dynamic_cast<BuiltInCommand*>(cmd.get());
+	if (builtin != nullptr && builtin->isLongRunning() && _isBackgroundCommand(cmd_line)) {
+		cmd.reset();
+		runInBackground(cmd_line, cmd_s);
+	} else {
+		if (builtin != nullptr && builtin->isLongRunning()) {
+			// don't hold earlier output back for the whole copy, nor behind its worker threads' errors
+			cout.flush();
+		}
+		cmd->execute();
+	}
     jobs_list->removeFinishedJobs();
 }
+
+/**
+* Runs a long built-in in a forked copy of smash, as a background job like an external command
+*/
+void SmallShell::runInBackground(const char* cmd_line, const string& cmd_s) {
+	// the built-in parses its arguments from the line without the &
+	string bg_cmd_line(cmd_line);
+	_removeBackgroundSign(&bg_cmd_line[0]);
+	cout.flush();
+	pid_t pid = fork();
+	if (pid == -1) {
+		_perror("smash error: fork failed");
+		return;
+	}
+	if (pid == 0) {
+		// child process, in a group of its own so that fg, kill and ctrl-Z reach it like any other job
+		setpgrp();
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		Command* cmd = createCommand(bg_cmd_line.c_str(), cmd_s);
+		cmd->execute();
+		cout.flush();
+		_exit(0);
+	}
+	// set here as well, the job may be signalled before the child gets to run
+	setpgid(pid, pid);
+	jobs_list->addJob(cmd_line, pid);
+}
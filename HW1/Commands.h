@@ -2,18 +2,55 @@
 #define SMASH_COMMAND_H_
 
 #include <vector>
+#include <string>
+#include <unordered_map>
+#include <set>
+#include <streambuf>
+#include <cstdint>
+#include <signal.h>
 
 using namespace std;
 
-#define COMMAND_ARGS_MAX_LENGTH (80)
-#define COMMAND_MAX_ARGS (20)
 #define HISTORY_MAX_RECORDS (50)
 #define BASH_PATH "/bin/bash"
+#define FD_STREAM_BUF_SIZE (65536)
+#define FD_STREAM_BUF_MAX (16 << 20) // how far smash's own stdout buffer may grow between flushes
+#define COPY_THREADS_DEFAULT (4) // mostly waiting on the disk, so not bound by the number of cpus
+#define COPY_CHUNK_SIZE_DEFAULT (64 << 20)
+
+/**
+* A command line split into words in a single pass. The words live in one arena, a copy of the line with a
+* NUL after every word, rather than in an allocation each; parsing again reuses the arena
+*/
+class CommandLine {
+    vector<char> arena;
+    vector<char*> words; // into arena, followed by a nullptr like argv
+public:
+    CommandLine() : words(1, nullptr) {}
+    explicit CommandLine(const char* cmd_line) : CommandLine() {
+        parse(cmd_line);
+    }
+    // the words point into this object's arena
+    CommandLine(const CommandLine&) = delete;
+    CommandLine& operator=(const CommandLine&) = delete;
+    void parse(const char* cmd_line);
+    void removeBackgroundSign();
+    int size() const {
+        return (int) words.size() - 1;
+    }
+    char** argv() {
+        return words.data();
+    }
+    const char* operator[](int i) const {
+        return words[i];
+    }
+};
 
 class Command {
 protected:
     const char* cmd;
-	char* args[COMMAND_MAX_ARGS];
+    CommandLine words;
+	char** args;
 	int args_num;
 public:
     explicit Command(const char* cmd_line);
@@ -25,25 +62,93 @@ class BuiltInCommand : public Command {
 public:
     explicit BuiltInCommand(const char* cmd_line) : Command(cmd_line) {}
     ~BuiltInCommand() override = default;
+    // a built-in that may take long runs as a job of its own when it ends with &, the rest ignore the &
+    virtual bool isLongRunning() const {
+        return false;
+    }
+};
+
+/**
+* Buffered output to a file descriptor, lets cout be pointed at a pipe without a fork
+*/
+class FdStreamBuf : public streambuf {
+    int fd;
+    size_t max_size;
+    volatile sig_atomic_t* cancel;
+    vector<char> buffer;
+    bool writeBuffer();
+    bool waitWritable();
+protected:
+    int overflow(int c) override;
+    int sync() override;
+public:
+    explicit FdStreamBuf(int fd, size_t max_size = FD_STREAM_BUF_SIZE, volatile sig_atomic_t* cancel = nullptr);
+    ~FdStreamBuf() override;
+};
+
+class CommandPathCache {
+    class CacheEntry {
+        string path;
+        int hits;
+    public:
+        explicit CacheEntry(string path) : path(path), hits(0) {}
+        string getPath() {
+            return path;
+        }
+        int getHits() {
+            return hits;
+        }
+        void hit() {
+            hits++;
+        }
+    };
+private:
+    unordered_map<string, CacheEntry> entries;
+    string cached_path_env;
+    int inotify_fd;
+    void validate();
+public:
+    CommandPathCache();
+    ~CommandPathCache();
+    string lookup(const string& name, bool count_hit = true);
+    void forget(const string& name);
+    void clear();
+    void printCache();
 };
 
 class JobsList;
 class ExternalCommand : public Command {
 	JobsList* jobs;
+	CommandPathCache* path_cache;
 public:
-    explicit ExternalCommand(const char* cmd_line, JobsList* jobs) : Command(cmd_line), jobs(jobs) {}
+    ExternalCommand(const char* cmd_line, JobsList* jobs, CommandPathCache* path_cache)
+        : Command(cmd_line), jobs(jobs), path_cache(path_cache) {}
     ~ExternalCommand() override = default;
     void execute() override;
 };
 
-//class PipeCommand : public Command {
-//    // TODO: Add your data members
-//public:
-//    PipeCommand(const char* cmd_line);
-//    virtual ~PipeCommand() {}
-//    void execute() override;
-//};
-//
+class PipeCommand : public Command {
+    struct PipeStage {
+        string cmd_line;
+        bool pipe_stderr; // |& rather than |
+    };
+    JobsList* jobs;
+    CommandPathCache* path_cache;
+    vector<PipeStage> stages;
+    bool parseStages(const string& cmd_line);
+    pid_t startStage(const PipeStage& stage, int in_fd, int out_fd, pid_t pgid);
+    static bool runsInProcess(const PipeStage& stage);
+    void runInProcess(const PipeStage& stage, int out_fd);
+public:
+    // set while cout points at the pipe of a stage run in smash, and once ctrl-Z/ctrl-C takes the pipeline away
+    static volatile sig_atomic_t stage_running;
+    static volatile sig_atomic_t stage_interrupted;
+    PipeCommand(const char* cmd_line, JobsList* jobs, CommandPathCache* path_cache)
+        : Command(cmd_line), jobs(jobs), path_cache(path_cache) {}
+    ~PipeCommand() override = default;
+    void execute() override;
+};
+
 //class RedirectionCommand : public Command {
 //    // TODO: Add your data members
 //public:
@@ -115,6 +220,14 @@ public:
     void printHistory();
 };
 
+class HashCommand : public BuiltInCommand {
+    CommandPathCache* path_cache;
+public:
+    HashCommand(const char* cmd_line, CommandPathCache* path_cache) : BuiltInCommand(cmd_line), path_cache(path_cache) {}
+    ~HashCommand() override = default;
+    void execute() override;
+};
+
 class HistoryCommand : public BuiltInCommand {
 	CommandsHistory* history;
 public:
@@ -132,8 +245,9 @@ public:
 	    pid_t pid;
 	    time_t added_time;
 	    JobStatus job_status;
+	    vector<pid_t> procs; // processes of the job that haven't been reaped yet
     public:
-        JobEntry(string cmd_line, int jobId, pid_t pid, time_t added_time);
+        JobEntry(string cmd_line, int jobId, pid_t pid, time_t added_time, vector<pid_t> procs = {});
         ~JobEntry() = default;
 	    bool operator< (const JobEntry& job_entry) const {
 		    return (jid < job_entry.jid);
@@ -153,25 +267,43 @@ public:
         JobStatus getJobStatus() {
 	    	return job_status;
 	    }
+	    vector<pid_t> getProcs() {
+		    return procs;
+	    }
+	    void removeProc(pid_t proc);
+    private:
+        // status changes go through JobsList::setJobStatus, which keeps the stopped jobs index up to date
 	    void setJobStatus(JobStatus new_status) {
 		    job_status = new_status;
 	    }
+	    friend class JobsList;
     };
 private:
 	int max_jid;
+	// the fg job lives in a slot of its own, reused by every fg command; fg_job points to it while there is one
+	JobEntry fg_entry;
 	JobEntry* fg_job;
-    vector<JobEntry> jobs;
+	// entries are owned by jobs (keyed by jid); references to them stay valid until they are removed
+    unordered_map<int, JobEntry> jobs;
+    unordered_map<pid_t, JobEntry*> jobs_by_pid;
+    set<int> jids;
+    set<int> stopped_jids;
 public:
+    // set by the SIGCHLD handler, tells removeFinishedJobs() there may be children to reap
+    static volatile sig_atomic_t child_changed;
     JobsList();
     ~JobsList() = default;
-    void addJob(string cmd_line, pid_t pid, int jid = 0);
+    void addJob(string cmd_line, pid_t pid, int jid = 0, vector<pid_t> procs = {});
     void printJobsList();
     void killAllJobs();
     void removeFinishedJobs();
     void removeJobById(int jobId);
 	void moveToFg(JobEntry* job_entry);
-	void setFgJob(JobEntry* job_entry);
+	void waitForFgJob(pid_t pgid);
+	void setFgJob(const JobEntry& job_entry);
+	void clearFgJob();
     JobEntry* getFgJob();
+	void setJobStatus(JobEntry* job_entry, JobStatus new_status);
 	JobEntry* getJobById(int jid);
 	JobEntry* getJobByPid(pid_t pid);
 	JobEntry* getLastJob();
@@ -212,23 +344,80 @@ public:
     void execute() override;
 };
 
+/**
+* How cp copies each file
+*/
+struct CopyOptions {
+    int threads_num; // --threads=N, for one big file or for the files of a tree
+    off_t chunk_size; // --chunk-size=BYTES, the range each thread copies at a time
+    string engine; // --engine=auto|range|rw|uring
+    bool direct; // --direct, O_DIRECT for the io_uring engine
+    bool update_blocks; // --update-blocks, rewrite only what changed in an existing copy
+    CopyOptions() : threads_num(COPY_THREADS_DEFAULT), chunk_size(COPY_CHUNK_SIZE_DEFAULT), engine("auto"),
+        direct(false), update_blocks(false) {}
+};
+
 class CopyCommand : public BuiltInCommand {
+    bool verbose; // -v, report how the file was copied and how fast
+    bool recursive; // -r, copy directories too
+    CopyOptions options;
+    vector<string> paths; // the sources, then the destination
+    bool parseArgs();
 public:
-    explicit CopyCommand(const char* cmd_line) : BuiltInCommand(cmd_line) {}
+    explicit CopyCommand(const char* cmd_line) : BuiltInCommand(cmd_line), verbose(false), recursive(false) {}
     ~CopyCommand() override = default;
+    bool isLongRunning() const override {
+        return true;
+    }
     void execute() override;
 };
 
 
+class SmallShell;
+typedef Command* (*CommandFactory)(const char* cmd_line, SmallShell& smash);
+
+/**
+* Finds built-ins by name with a perfect hash: registering picks a table size and seed under which every name
+* has a slot of its own, so a lookup hashes the name once and compares it with a single entry
+*/
+class BuiltInTable {
+public:
+    struct Entry {
+        string name;
+        CommandFactory factory;
+        // only prints, without reading stdin or changing anything a fork would keep apart,
+        // so as a pipeline stage it runs inside smash
+        bool runs_in_process;
+    };
+private:
+    vector<Entry> entries;
+    vector<Entry> slots; // a power of two of them
+    uint32_t seed;
+    static uint32_t hash(const string& name, uint32_t seed);
+    bool placeAll(size_t slots_num, uint32_t seed);
+public:
+    BuiltInTable() : slots(1), seed(0) {}
+    void add(const string& name, CommandFactory factory, bool runs_in_process);
+    const Entry* find(const string& name) const;
+};
+
 class SmallShell {
 private:
+    pid_t pid;
     string curr_wd;
     string last_wd;
 	CommandsHistory* cmd_history;
     JobsList* jobs_list;
+    CommandPathCache* path_cache;
+    BuiltInTable builtins;
     SmallShell();
+    void runInBackground(const char* cmd_line, const string& cmd_s);
 public:
     Command* createCommand(const char* cmd_line, string cmd_s);
+    void registerBuiltIn(const string& name, CommandFactory factory, bool runs_in_process = false);
+    const BuiltInTable::Entry* findBuiltIn(const string& name) const {
+        return builtins.find(name);
+    }
     SmallShell(SmallShell const &) = delete; // disable copy ctor
     void operator=(SmallShell const &) = delete; // disable = operator
     static SmallShell &getInstance() // make SmallShell singleton
@@ -255,6 +444,9 @@ public:
     JobsList* getJobsList() {
 	    return jobs_list;
     }
+    pid_t getPid() {
+	    return pid;
+    }
 };
 
 #endif //SMASH_COMMAND_H_
@@ -0,0 +1,30 @@
+#!/bin/bash
+# Throughput of smash's cp engines on one file, each copy to a fresh destination:
+#   rw     - pread/pwrite through a 1 MiB buffer, single thread
+#   range  - copy_file_range, single thread
+#   uring  - io_uring, reads linked to their writes, optionally with O_DIRECT
+# The page cache is warm after the first run, pass a file bigger than RAM for disk numbers.
+# usage: ./bench_cp.sh [smash binary] [file size in MiB] [directory]
+
+SMASH_BIN=$(realpath "${1:-./smash}")
+SIZE_MB=${2:-512}
+DIR=${3:-/tmp}
+SRC="$DIR/bench_cp.src"
+DST="$DIR/bench_cp.dst"
+
+head -c "${SIZE_MB}M" /dev/urandom > "$SRC"
+
+run() {
+	local name=$1 options=$2
+	rm -f "$DST"
+	printf "%-14s" "$name:"
+	echo "cp -v $options $SRC $DST" | "$SMASH_BIN" | grep -o '[0-9.]* MB/s'
+}
+
+run "rw" "--engine=rw --threads=1"
+run "range" "--engine=range --threads=1"
+run "uring" "--engine=uring"
+run "uring direct" "--engine=uring --direct"
+run "range x4" "--engine=range --threads=4"
+
+rm -f "$SRC" "$DST"
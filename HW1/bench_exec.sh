@@ -0,0 +1,20 @@
+#!/bin/bash
+# Commands-per-second of smash's external command launch paths:
+#   direct - `true`, a simple command that smash execv's itself
+#   bash   - `"true"`, the quotes send it through /bin/bash -c
+# usage: ./bench_exec.sh [smash binary] [commands per run]
+
+SMASH_BIN=${1:-./smash}
+COMMANDS_NUM=${2:-2000}
+
+run() {
+	local name=$1 line=$2
+	local start end
+	start=$(date +%s.%N)
+	{ for ((i = 0; i < COMMANDS_NUM; i++)); do echo "$line"; done; echo "quit"; } | "$SMASH_BIN" > /dev/null
+	end=$(date +%s.%N)
+	awk -v n="$COMMANDS_NUM" -v s="$start" -v e="$end" -v name="$name" 'BEGIN { printf "%s: %.0f commands/sec\n", name, n / (e - s) }'
+}
+
+run "direct" 'true'
+run "bash  " '"true"'
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+// fork+exec vs posix_spawn latency of /bin/true while the parent's resident memory grows,
+// the way smash's grows with its history and jobs tables
+// usage: ./bench_spawn [launches per step]
+
+using namespace std;
+
+extern char** environ;
+
+#define TRUE_PATH "/bin/true"
+#define MB (1024 * 1024)
+
+const int RSS_STEPS_MB[] = {0, 64, 256, 1024};
+
+double launchForkExec() {
+	auto start = chrono::steady_clock::now();
+	pid_t pid = fork();
+	if (pid == 0) {
+		setpgrp();
+		execl(TRUE_PATH, "true", nullptr);
+		_exit(1);
+	}
+	waitpid(pid, nullptr, 0);
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+double launchSpawn() {
+	auto start = chrono::steady_clock::now();
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	char* args[] = {(char*) "true", nullptr};
+	pid_t pid;
+	if (posix_spawn(&pid, TRUE_PATH, nullptr, &attr, args, environ) == 0) {
+		waitpid(pid, nullptr, 0);
+	}
+	posix_spawnattr_destroy(&attr);
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[]) {
+	int launches = argc > 1 ? atoi(argv[1]) : 200;
+	vector<char*> ballast;
+	int rss_mb = 0;
+
+	cout << setw(8) << "RSS MB" << setw(16) << "fork+exec us" << setw(16) << "posix_spawn us" << endl;
+	for (int step_mb : RSS_STEPS_MB) {
+		// grow and touch the memory, so it's really resident and has page tables to copy
+		for (; rss_mb < step_mb; ++rss_mb) {
+			char* block = (char*) malloc(MB);
+			memset(block, 1, MB);
+			ballast.push_back(block);
+		}
+		double fork_us = 0, spawn_us = 0;
+		for (int i = 0; i < launches; ++i) {
+			fork_us += launchForkExec();
+			spawn_us += launchSpawn();
+		}
+		cout << setw(8) << step_mb << fixed << setprecision(1)
+		     << setw(16) << fork_us / launches << setw(16) << spawn_us / launches << endl;
+	}
+	for (char* block : ballast) {
+		free(block);
+	}
+	return 0;
+}
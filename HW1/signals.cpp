@@ -1,38 +1,61 @@
 #include <iostream>
+#include <string>
+#include <unistd.h>
 #include <signal.h>
 #include "signals.h"
 #include "Commands.h"
 
 using namespace std;
 
+/**
+* Writes @param msg straight to stdout. cout may be pointed at the pipe of a stage smash runs itself,
+* so it's only flushed (to keep the order) when it isn't
+*/
+static void printSignalMessage(const string& msg) {
+	if (!PipeCommand::stage_running) {
+		cout.flush();
+	}
+	ssize_t written = write(STDOUT_FILENO, msg.data(), msg.size());
+	(void) written;
+}
+
 void ctrlZHandler(int sig_num) {
-	cout << "smash: got ctrl-Z" << endl;
+	printSignalMessage("smash: got ctrl-Z\n");
 	SmallShell& smash = SmallShell::getInstance();
 	JobsList::JobEntry* fg_job = smash.getJobsList()->getFgJob();
 	if (fg_job != nullptr) {
 		pid_t fg_job_pid = fg_job->getJobPid();
-		if (kill(fg_job_pid, SIGSTOP) == -1) {
+		// the job's pid is its process group id, the whole pipeline is stopped
+		if (kill(-fg_job_pid, SIGSTOP) == -1) {
 			perror("smash error: kill failed");
 		} else {
-			smash.getJobsList()->addJob(fg_job->getCmdLine(), fg_job_pid, fg_job->getJobId());
-			smash.getJobsList()->getJobByPid(fg_job_pid)->setJobStatus(JobsList::JobStatus::Stopped);
-			smash.getJobsList()->setFgJob(nullptr);
-			cout << "smash: process " << fg_job_pid << " was stopped" << endl;
+			smash.getJobsList()->addJob(fg_job->getCmdLine(), fg_job_pid, fg_job->getJobId(), fg_job->getProcs());
+			smash.getJobsList()->setJobStatus(smash.getJobsList()->getJobByPid(fg_job_pid), JobsList::JobStatus::Stopped);
+			smash.getJobsList()->clearFgJob();
+			// a stage running in smash stops writing to the stopped pipeline
+			PipeCommand::stage_interrupted = 1;
+			printSignalMessage("smash: process " + to_string(fg_job_pid) + " was stopped\n");
 		}
 	}
 }
 
 void ctrlCHandler(int sig_num) {
-	cout << "smash: got ctrl-C" << endl;
+	printSignalMessage("smash: got ctrl-C\n");
 	SmallShell& smash = SmallShell::getInstance();
 	JobsList::JobEntry* fg_job = smash.getJobsList()->getFgJob();
 	if (fg_job != nullptr) {
 		pid_t fg_job_pid = fg_job->getJobPid();
-		if (kill(fg_job_pid, SIGKILL) == -1) {
+		if (kill(-fg_job_pid, SIGKILL) == -1) {
 			perror("smash error: kill failed");
 		} else {
-			smash.getJobsList()->setFgJob(nullptr);
-			cout << "smash: process " << fg_job_pid << " was killed" << endl;
+			smash.getJobsList()->clearFgJob();
+			PipeCommand::stage_interrupted = 1;
+			printSignalMessage("smash: process " + to_string(fg_job_pid) + " was killed\n");
 		}
 	}
 }
+
+void sigchldHandler(int sig_num) {
+	// only note it, the children are reaped by JobsList::removeFinishedJobs() between commands
+	JobsList::child_changed = 1;
+}
@@ -5,4 +5,6 @@ void ctrlZHandler(int sig_num);
 
 void ctrlCHandler(int sig_num);
 
+void sigchldHandler(int sig_num);
+
 #endif //SMASH__SIGNALS_H_
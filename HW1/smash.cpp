@@ -2,9 +2,74 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
 #include "Commands.h"
 #include "signals.h"
 
+#define BATCH_READ_SIZE (1 << 16)
+
+static long batch_commands_num = 0;
+static std::chrono::steady_clock::time_point batch_start;
+
+/**
+* Writes out smash's buffered stdout at exit, quit included.
+* Registered after cout is set up, so it runs before cout's own cleanup
+*/
+static void flushStdout() {
+	std::cout.flush();
+}
+
+/**
+* Reports the speed of a batch run on stderr, also when the script ends with quit
+*/
+static void reportBatch() {
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count();
+	std::cout.flush();
+	std::cerr << "smash: " << batch_commands_num << " commands in " << secs << " s ("
+	          << (secs > 0 ? (long) (batch_commands_num / secs) : 0) << " commands/sec)" << std::endl;
+}
+
+/**
+* Runs the commands in @param fd without prompts, reading it BATCH_READ_SIZE bytes at a time.
+* What smash reads ahead is gone for the commands themselves, they shouldn't read the script
+*/
+static void runBatch(SmallShell& smash, int fd) {
+	batch_start = std::chrono::steady_clock::now();
+	atexit(reportBatch);
+	std::vector<char> buf(BATCH_READ_SIZE);
+	std::string cmd_line;
+	while (true) {
+		ssize_t count = read(fd, buf.data(), buf.size());
+		if (count == -1 && errno == EINTR) {
+			continue;
+		} else if (count == -1) {
+			perror("smash error: read failed");
+			break;
+		} else if (count == 0) {
+			break;
+		}
+		char* start = buf.data();
+		char* end = buf.data() + count;
+		for (char* newline; (newline = (char*) memchr(start, '\n', end - start)) != nullptr; start = newline + 1) {
+			cmd_line.append(start, newline);
+			batch_commands_num++;
+			smash.executeCommand(cmd_line.c_str());
+			cmd_line.clear();
+		}
+		cmd_line.append(start, end);
+	}
+	// the last line may have no newline
+	if (!cmd_line.empty()) {
+		batch_commands_num++;
+		smash.executeCommand(cmd_line.c_str());
+	}
+}
+
 int main(int argc, char* argv[]) {
 	if (signal(SIGTSTP, ctrlZHandler) == SIG_ERR) {
 		perror("smash error: failed to set ctrl-Z handler");
@@ -12,13 +77,38 @@ int main(int argc, char* argv[]) {
 	if (signal(SIGINT, ctrlCHandler) == SIG_ERR) {
 		perror("smash error: failed to set ctrl-C handler");
 	}
+	if (signal(SIGCHLD, sigchldHandler) == SIG_ERR) {
+		perror("smash error: failed to set SIGCHLD handler");
+	}
+	if (argc > 2) {
+		std::cerr << "usage: smash [-s | script]" << std::endl;
+		return 1;
+	}
+
+	// smash's own output is buffered and flushed at the prompt, before running other programs and at exit
+	// (never freed, cout may still be flushed through it while exiting)
+	std::cout.rdbuf(new FdStreamBuf(STDOUT_FILENO, FD_STREAM_BUF_MAX));
+	atexit(flushStdout);
 
 	SmallShell &smash = SmallShell::getInstance();
+	if (argc == 2) {
+		// smash -s runs stdin as a script, smash script.txt runs the file (kept from the commands it runs)
+		int fd = strcmp(argv[1], "-s") == 0 ? STDIN_FILENO : open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd == -1) {
+			perror("smash error: open failed");
+			return 1;
+		}
+		runBatch(smash, fd);
+		return 0;
+	}
+
 	while (true) {
-		std::cout << "smash> ";
+		std::cout << "smash> " << std::flush;
 		std::string cmd_line;
-		std::getline(std::cin, cmd_line);
+		if (!std::getline(std::cin, cmd_line)) {
+			break;
+		}
 		smash.executeCommand(cmd_line.c_str());
 	}
 	return 0;
-}
\ No newline at end of file
+}
@@ -2,12 +2,158 @@
 #define THREAD_SAFE_LIST_H_
 
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string>
+#include <cstring> // memcpy
+#include <cstdio> // rename
 #include <iostream>
 #include <iomanip> // std::setw
+#include <utility> // std::forward, std::move
+#include <new> // placement new
+#include <type_traits> // std::aligned_storage, std::is_trivially_destructible
+#include <vector>
+#include <deque>
+#include <algorithm> // std::min
+#include <functional>
+#include <memory> // std::shared_ptr
 
 using namespace std;
 
 const unsigned int INITIAL_LIST_SIZE = 0;
+const unsigned int NODE_ARENA_CHUNK_SIZE = 256;
+const uint64_t LIST_FILE_MAGIC = 0x314c4649534c5354; // "TSLSIFL1"
+const unsigned int SEGMENTS_PER_THREAD = 4;
+const unsigned int CACHE_LINE_SIZE = 64;
+
+/**
+* Runs tasks 0..tasks_num-1 on a fixed set of threads (the calling thread included).
+* Every thread starts with a contiguous share of the tasks in its own deque and takes from its front;
+* once it runs dry it steals from the back of the other threads' deques. A running task may also
+* claim() a given task that nobody has taken yet and run it itself
+*/
+class WorkStealingPool {
+	public:
+		explicit WorkStealingPool(unsigned int threads_num) : queues(threads_num) {
+			for (unsigned int i = 0; i < threads_num; ++i) {
+				pthread_mutex_init(&queues[i].queue_mutex, NULL);
+			}
+		}
+
+		~WorkStealingPool() {
+			for (unsigned int i = 0; i < queues.size(); ++i) {
+				pthread_mutex_destroy(&queues[i].queue_mutex);
+			}
+		}
+
+		/**
+		* Runs @param task for every task index and returns once all of them are done
+		*/
+		void run(unsigned int tasks_num, const std::function<void(unsigned int)>& task) {
+			const unsigned int threads_num = queues.size();
+			for (unsigned int i = 0; i < tasks_num; ++i) {
+				queues[(unsigned long)i * threads_num / tasks_num].tasks.push_back(i);
+			}
+			this->task = &task;
+
+			std::vector<WorkerArgs> args(threads_num);
+			std::vector<pthread_t> threads(threads_num);
+			std::vector<bool> started(threads_num, false);
+			for (unsigned int i = 1; i < threads_num; ++i) {
+				args[i].pool = this;
+				args[i].id = i;
+				// if a thread can't be created, its tasks are stolen by the others
+				started[i] = pthread_create(&threads[i], NULL, workerEntry, &args[i]) == 0;
+			}
+			work(0);
+			for (unsigned int i = 1; i < threads_num; ++i) {
+				if (started[i]) {
+					pthread_join(threads[i], NULL);
+				}
+			}
+		}
+
+		/**
+		* Takes @param task_id away from the pool if no thread has taken it yet, the caller runs it instead.
+		* The deques hold contiguous ranges, so a task that is still queued right after a taken one is at a front
+		* @return true if the task was claimed
+		*/
+		bool claim(unsigned int task_id) {
+			for (unsigned int i = 0; i < queues.size(); ++i) {
+				TaskQueue& queue = queues[i];
+				pthread_mutex_lock(&queue.queue_mutex);
+				bool found = !queue.tasks.empty() && queue.tasks.front() == task_id;
+				if (found) {
+					queue.tasks.pop_front();
+				}
+				pthread_mutex_unlock(&queue.queue_mutex);
+				if (found) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+	private:
+		struct TaskQueue {
+			std::deque<unsigned int> tasks;
+			pthread_mutex_t queue_mutex;
+		};
+		struct WorkerArgs {
+			WorkStealingPool *pool;
+			unsigned int id;
+		};
+
+		std::vector<TaskQueue> queues;
+		const std::function<void(unsigned int)> *task;
+
+		static void* workerEntry(void *arg) {
+			WorkerArgs *args = static_cast<WorkerArgs*>(arg);
+			args->pool->work(args->id);
+			return NULL;
+		}
+
+		bool takeTask(unsigned int queue_id, bool steal, unsigned int *task_id) {
+			TaskQueue& queue = queues[queue_id];
+			bool found = false;
+			pthread_mutex_lock(&queue.queue_mutex);
+			if (!queue.tasks.empty()) {
+				if (steal) {
+					*task_id = queue.tasks.back();
+					queue.tasks.pop_back();
+				} else {
+					*task_id = queue.tasks.front();
+					queue.tasks.pop_front();
+				}
+				found = true;
+			}
+			pthread_mutex_unlock(&queue.queue_mutex);
+			return found;
+		}
+
+		void work(unsigned int id) {
+			const unsigned int threads_num = queues.size();
+			unsigned int task_id;
+			while (takeTask(id, false, &task_id)) {
+				(*task)(task_id);
+			}
+			// tasks are never added while running, so one sweep that finds nothing means we're done
+			bool stole = true;
+			while (stole) {
+				stole = false;
+				for (unsigned int i = 1; i < threads_num; ++i) {
+					if (takeTask((id + i) % threads_num, true, &task_id)) {
+						(*task)(task_id);
+						stole = true;
+					}
+				}
+			}
+		}
+};
 
 template <typename T>
 class List {
@@ -15,8 +161,8 @@ class List {
 		/**
 		* Constructor
 		*/
-		List() : size(INITIAL_LIST_SIZE) {
-			head = new Node(T());
+		List() : arena(std::make_shared<NodeArena>()), size(INITIAL_LIST_SIZE) {
+			head = new Link();
 			pthread_mutex_init(&list_mutex, NULL);
 		}
 
@@ -24,21 +170,40 @@ class List {
 		* Destructor
 		*/
 		~List() {
+			clear();
 			pthread_mutex_destroy(&list_mutex);
-			pthread_mutex_destroy(&head->node_mutex);
 			delete head;
 		}
 
-		class Node {
+		class Node;
+
+		/**
+		* The linking part of a node: next pointer and the hand-over-hand lock.
+		* The dummy head is a bare Link, so T does not need a default constructor
+		*/
+		class Link {
 			public:
-				T data;
 				Node *next;
 				pthread_mutex_t node_mutex;
 
-				Node(T data) : data(data), next(NULL) {
+				Link() : next(NULL) {
 					pthread_mutex_init(&node_mutex, NULL);
 				}
 
+				~Link() {
+					pthread_mutex_destroy(&node_mutex);
+				}
+		};
+
+		class Node : public Link {
+			public:
+				T data;
+
+				/**
+				* Constructs data in place from @param args
+				*/
+				template <typename... Args>
+				explicit Node(Args&&... args) : Link(), data(std::forward<Args>(args)...) {}
 		};
 
 		/**
@@ -47,54 +212,30 @@ class List {
 		* @param data the new data to be added to the list
 		* @return true if a new node was added and false otherwise
 		*/
-		bool insert(const T& data)  {
-			// lock dummy node
-			Node *prev = head;
-			pthread_mutex_lock(&prev->node_mutex);
-
-			if (prev->next == NULL) {
-				// in case list is empty
-				Node* newNode = new Node(data);
-				prev->next = newNode;
-				pthread_mutex_lock(&list_mutex);
-				size++;
-				pthread_mutex_unlock(&list_mutex);
-				__add_hook();
-				pthread_mutex_unlock(&prev->node_mutex);
-				return true;
-			}
-
-			Node *curr = prev;
+		bool insert(const T& data) {
+			return insertNode(data, [this, &data]() { return allocNode(data); });
+		}
 
-			// iterating over the list
-			while (curr->next != NULL && curr->next->data <= data){
-				if (curr->next->data == data){
-					// value exists in list, unlock and return false
-					pthread_mutex_unlock(&curr->node_mutex);
-					return false;
-				}
-				prev = curr;
-				curr = curr->next;
-				pthread_mutex_lock(&curr->node_mutex);
-				pthread_mutex_unlock(&prev->node_mutex);
-			}
+		/**
+		* Same as insert(const T&), but moves @param data into the new node instead of copying it
+		* @return true if a new node was added and false otherwise
+		*/
+		bool insert(T&& data) {
+			return insertNode(data, [this, &data]() { return allocNode(std::move(data)); });
+		}
 
-			if (curr != head && curr->data == data){
-				// value exists in list, unlock and return false
-				pthread_mutex_unlock(&curr->node_mutex);
-				return false;
+		/**
+		* Constructs the new data in place from @param args and inserts it like insert(const T&)
+		* @return true if a new node was added and false otherwise (the constructed data is discarded)
+		*/
+		template <typename... Args>
+		bool emplace(Args&&... args) {
+			Node *newNode = allocNode(std::forward<Args>(args)...);
+			if (insertNode(newNode->data, [newNode]() { return newNode; })) {
+				return true;
 			}
-
-			// adding new node
-			Node *newNode = new Node(data);
-			newNode->next = curr->next;
-			curr->next = newNode;
-			pthread_mutex_lock(&list_mutex);
-			size++;
-			pthread_mutex_unlock(&list_mutex);
-			__add_hook();
-			pthread_mutex_unlock(&curr->node_mutex);
-			return true;
+			freeNode(newNode);
+			return false;
 		}
 
 		/**
@@ -104,7 +245,7 @@ class List {
 		*/
 		bool remove(const T& value) {
 			// lock dummy node
-			Node *prev = head;
+			Link *prev = head;
 			pthread_mutex_lock(&prev->node_mutex);
 
 			if (prev->next == NULL) {
@@ -127,8 +268,7 @@ class List {
 					__remove_hook();
 					// unlock and deallocate mem
 					pthread_mutex_unlock(&curr->node_mutex);
-					pthread_mutex_destroy(&curr->node_mutex);
-					delete curr;
+					freeNode(curr);
 					pthread_mutex_unlock(&prev->node_mutex);
 					return true;
 				}
@@ -148,8 +288,7 @@ class List {
 				__remove_hook();
 				// unlock and deallocate mem
 				pthread_mutex_unlock(&curr->node_mutex);
-				pthread_mutex_destroy(&curr->node_mutex);
-				delete curr;
+				freeNode(curr);
 				pthread_mutex_unlock(&prev->node_mutex);
 				return true;
 			}
@@ -160,6 +299,149 @@ class List {
 			return false;
 		}
 
+		/**
+		* Removes all nodes from the list. Their memory goes back to the system a chunk at a time,
+		* and when T is trivially destructible the nodes are not even visited. Chunks still holding
+		* nodes that were moved to other lists stay alive until those lists let go of them.
+		* Like the destructor, must not run concurrently with other operations on the list
+		*/
+		void clear() {
+			Node *curr = head->next;
+			head->next = NULL;
+			if (!std::is_trivially_destructible<T>::value) {
+				while (curr != NULL) {
+					Node *next = curr->next;
+					curr->~Node();
+					curr = next;
+				}
+			}
+			// the node mutexes use default attributes and hold no resources, so skipping
+			// their pthread_mutex_destroy() for trivially destructible T is safe
+			if (arena.use_count() == 1) {
+				arena->releaseAll();
+			} else {
+				arena = std::make_shared<NodeArena>();
+			}
+			borrowed_arenas.clear();
+			size = 0;
+		}
+
+		/**
+		* Saves the list to @param path as a header followed by a compact sorted array of T.
+		* The values are written through a shared mapping of a temporary file, which is msync'ed
+		* and then renamed over @param path, so a crash never leaves a half written checkpoint.
+		* Concurrent inserts and removes are allowed; like any hand-over-hand traversal this
+		* is not an atomic snapshot of the list. Only for trivially copyable T
+		* @return true on success and false otherwise (errno is set)
+		*/
+		bool checkpoint(const char* path) {
+			static_assert(std::is_trivially_copyable<T>::value, "checkpoint() requires a trivially copyable T");
+			const std::string tmp_path = std::string(path) + ".tmp";
+			int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0664);
+			if (fd == -1) {
+				return false;
+			}
+
+			uint64_t capacity = size > 0 ? size : 1;
+			char* map = mapListFile(fd, capacity);
+			if (map == NULL) {
+				closeAndUnlink(fd, tmp_path);
+				return false;
+			}
+
+			uint64_t count = 0;
+			Link *prev = head;
+			pthread_mutex_lock(&prev->node_mutex);
+			while (prev->next != NULL) {
+				Node *curr = prev->next;
+				pthread_mutex_lock(&curr->node_mutex);
+				pthread_mutex_unlock(&prev->node_mutex);
+				if (count == capacity) {
+					// the list grew since we sized the file, remap a bigger one
+					munmap(map, listFileSize(capacity));
+					capacity *= 2;
+					map = mapListFile(fd, capacity);
+					if (map == NULL) {
+						pthread_mutex_unlock(&curr->node_mutex);
+						closeAndUnlink(fd, tmp_path);
+						return false;
+					}
+				}
+				memcpy(map + listFileSize(count), &curr->data, sizeof(T));
+				count++;
+				prev = curr;
+			}
+			pthread_mutex_unlock(&prev->node_mutex);
+
+			ListFileHeader header = {LIST_FILE_MAGIC, sizeof(T), 0, count};
+			memcpy(map, &header, sizeof(header));
+			bool ok = ftruncate(fd, listFileSize(count)) == 0 && msync(map, listFileSize(count), MS_SYNC) == 0;
+			munmap(map, listFileSize(capacity));
+			if (!ok || rename(tmp_path.c_str(), path) == -1) {
+				closeAndUnlink(fd, tmp_path);
+				return false;
+			}
+			return close(fd) == 0;
+		}
+
+		/**
+		* Replaces the contents of the list with a checkpoint saved to @param path.
+		* The file is mapped and the node chain is rebuilt in one linear pass, without searching
+		* for each value's position. Like clear(), must not run concurrently with other operations
+		* on the list. Only for trivially copyable T
+		* @return true on success and false otherwise (errno is set, the list is left empty)
+		*/
+		bool restore(const char* path) {
+			static_assert(std::is_trivially_copyable<T>::value, "restore() requires a trivially copyable T");
+			clear();
+			int fd = open(path, O_RDONLY);
+			if (fd == -1) {
+				return false;
+			}
+			struct stat st;
+			if (fstat(fd, &st) == -1) {
+				close(fd);
+				return false;
+			}
+			ListFileHeader header;
+			if ((size_t)st.st_size < listFileSize(0)) {
+				close(fd);
+				errno = EINVAL;
+				return false;
+			}
+			char* map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (map == MAP_FAILED) {
+				return false;
+			}
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			memcpy(&header, map, sizeof(header));
+			if (header.magic != LIST_FILE_MAGIC || header.data_size != sizeof(T)
+			    || header.count > (st.st_size - listFileSize(0)) / sizeof(T)) {
+				munmap(map, st.st_size);
+				errno = EINVAL;
+				return false;
+			}
+
+			Link *tail = head;
+			for (uint64_t i = 0; i < header.count; ++i) {
+				Node *node = allocNode(*reinterpret_cast<const T*>(map + listFileSize(i)));
+				if (tail != head && node->data <= static_cast<Node*>(tail)->data) {
+					// not strictly ascending, the file is corrupt
+					freeNode(node);
+					munmap(map, st.st_size);
+					clear();
+					errno = EINVAL;
+					return false;
+				}
+				tail->next = node;
+				tail = node;
+			}
+			size = header.count;
+			munmap(map, st.st_size);
+			return true;
+		}
+
 		/**
 		* Returns the current size of the list
 		* @return the list size
@@ -168,6 +450,128 @@ class List {
 			return size;
 		}
 
+		/**
+		* Calls @param func(const T&) for every value, splitting the list into segments that are
+		* processed on @param threads_num threads (0 means one per online CPU) with work stealing.
+		* The list is frozen for the duration: nodes are locked in list order, a segment at a time, and
+		* stay locked until their segment is visited, so concurrent inserts and removes wait and then see the result.
+		* func must not throw or call back into this list
+		*/
+		template <typename Func>
+		void parallelForEach(Func func, unsigned int threads_num = 0) {
+			forEachSegment([&func](unsigned int, const T& data) { func(data); }, threads_num);
+		}
+
+		/**
+		* Folds every value into a result: each segment computes @param func(R acc, const T&) starting
+		* from @param identity, and the partial results are joined with @param combine(R, R) in list order.
+		* Segments are processed like in parallelForEach()
+		* @return the combined result, identity for an empty list
+		*/
+		template <typename R, typename Func, typename Combine>
+		R parallelReduce(R identity, Func func, Combine combine, unsigned int threads_num = 0) {
+			// one padded slot per segment: no two segments share a word (std::vector<bool>) or a cache line
+			struct Partial {
+				R value;
+				char padding[CACHE_LINE_SIZE];
+				explicit Partial(const R& value) : value(value) {}
+			};
+			std::vector<Partial> partials;
+			forEachSegment([&partials, &func](unsigned int segment, const T& data) {
+				partials[segment].value = func(std::move(partials[segment].value), data);
+			}, threads_num, [&partials, &identity](unsigned int segments_num) {
+				partials.assign(segments_num, Partial(identity));
+			});
+			R result = identity;
+			for (unsigned int i = 0; i < partials.size(); ++i) {
+				result = combine(std::move(result), std::move(partials[i].value));
+			}
+			return result;
+		}
+
+		/**
+		* Atomically moves the node holding @param key from this list to @param other: no thread
+		* can observe the key in neither or both lists. The node is relinked, not reallocated.
+		* Locks are taken in a global order (lower list address first), so opposite moves between
+		* the same two lists can't deadlock. The add/remove hooks are not called
+		* @return true if the key was moved, false if it isn't in this list or is already in other
+		*/
+		bool moveTo(List& other, const T& key) {
+			return transferRange(key, key, other) == 1;
+		}
+
+		/**
+		* Atomically moves every node whose data is in [@param lo, @param hi] to @param other,
+		* splicing each run of consecutive nodes that lands between the same two nodes of other
+		* with a single relink. Keys already in other stay in this list.
+		* Locking is the same as in moveTo()
+		* @return the number of nodes moved
+		*/
+		unsigned int transferRange(const T& lo, const T& hi, List& other) {
+			if (&other == this || !(lo <= hi)) {
+				return 0;
+			}
+			std::vector<Link*> src_locked;
+			std::vector<Link*> dst_locked;
+			Link *src_prev;
+			Link *dst_prev;
+			if (std::less<List*>()(this, &other)) {
+				src_prev = lockRange(lo, hi, src_locked);
+				dst_prev = other.lockRange(lo, hi, dst_locked);
+			} else {
+				dst_prev = other.lockRange(lo, hi, dst_locked);
+				src_prev = lockRange(lo, hi, src_locked);
+			}
+
+			unsigned int moved = 0;
+			if (src_locked.size() > 1) {
+				other.borrowArenas(*this);
+				// every node up to the ones with data > hi is locked; reading the data of
+				// the first unlocked node is fine, its locked predecessor keeps it in place
+				Node *src = src_prev->next;
+				while (src != NULL && src->data <= hi) {
+					while (dst_prev->next != NULL && !(src->data <= dst_prev->next->data)) {
+						dst_prev = dst_prev->next;
+					}
+					Node *bound = dst_prev->next;
+					if (bound != NULL && bound->data == src->data) {
+						// already in other, leave it here
+						src_prev = src;
+						src = src->next;
+						continue;
+					}
+					// the longest run of src that fits before bound
+					Node *run_end = src;
+					unsigned int run_len = 1;
+					while (run_end->next != NULL && run_end->next->data <= hi
+					       && (bound == NULL || !(bound->data <= run_end->next->data))) {
+						run_end = run_end->next;
+						run_len++;
+					}
+					src_prev->next = run_end->next;
+					run_end->next = bound;
+					dst_prev->next = src;
+					dst_prev = run_end;
+					moved += run_len;
+					src = src_prev->next;
+				}
+				pthread_mutex_lock(&list_mutex);
+				size -= moved;
+				pthread_mutex_unlock(&list_mutex);
+				pthread_mutex_lock(&other.list_mutex);
+				other.size += moved;
+				pthread_mutex_unlock(&other.list_mutex);
+			}
+
+			for (unsigned int i = 0; i < src_locked.size(); ++i) {
+				pthread_mutex_unlock(&src_locked[i]->node_mutex);
+			}
+			for (unsigned int i = 0; i < dst_locked.size(); ++i) {
+				pthread_mutex_unlock(&dst_locked[i]->node_mutex);
+			}
+			return moved;
+		}
+
 		// Don't remove
 		void print() {
 			pthread_mutex_lock(&list_mutex);
@@ -193,7 +597,390 @@ class List {
 		virtual void __remove_hook() {}
 
 	private:
-		Node* head;
+		/**
+		* Chunked node storage. Chunks of NODE_ARENA_CHUNK_SIZE nodes are only given back all together,
+		* slots of removed nodes are recycled through a free list in the meantime
+		*/
+		class NodeArena {
+			struct FreeSlot {
+				FreeSlot *next;
+			};
+			struct Chunk {
+				Chunk *prev;
+				typename std::aligned_storage<sizeof(Node), alignof(Node)>::type slots[NODE_ARENA_CHUNK_SIZE];
+			};
+
+			Chunk *last_chunk;
+			unsigned int used_slots; // slots of last_chunk handed out so far
+			FreeSlot *free_slots;
+			pthread_mutex_t arena_mutex;
+
+			public:
+				NodeArena() : last_chunk(NULL), used_slots(NODE_ARENA_CHUNK_SIZE), free_slots(NULL) {
+					pthread_mutex_init(&arena_mutex, NULL);
+				}
+
+				~NodeArena() {
+					releaseAll();
+					pthread_mutex_destroy(&arena_mutex);
+				}
+
+				void* allocate() {
+					void *slot;
+					pthread_mutex_lock(&arena_mutex);
+					if (free_slots != NULL) {
+						slot = free_slots;
+						free_slots = free_slots->next;
+					} else {
+						if (used_slots == NODE_ARENA_CHUNK_SIZE) {
+							Chunk *chunk = new Chunk;
+							chunk->prev = last_chunk;
+							last_chunk = chunk;
+							used_slots = 0;
+						}
+						slot = &last_chunk->slots[used_slots++];
+					}
+					pthread_mutex_unlock(&arena_mutex);
+					return slot;
+				}
+
+				void deallocate(void *slot) {
+					pthread_mutex_lock(&arena_mutex);
+					FreeSlot *free_slot = static_cast<FreeSlot*>(slot);
+					free_slot->next = free_slots;
+					free_slots = free_slot;
+					pthread_mutex_unlock(&arena_mutex);
+				}
+
+				/**
+				* Frees every chunk, invalidating all the slots handed out
+				*/
+				void releaseAll() {
+					pthread_mutex_lock(&arena_mutex);
+					while (last_chunk != NULL) {
+						Chunk *prev = last_chunk->prev;
+						delete last_chunk;
+						last_chunk = prev;
+					}
+					used_slots = NODE_ARENA_CHUNK_SIZE;
+					free_slots = NULL;
+					pthread_mutex_unlock(&arena_mutex);
+				}
+		};
+
+		struct ListFileHeader {
+			uint64_t magic;
+			uint32_t data_size;
+			uint32_t reserved;
+			uint64_t count;
+		};
+
+		/**
+		* Size of a checkpoint file holding @param count values; the values start right after the
+		* header, rounded up to T's alignment
+		*/
+		static size_t listFileSize(uint64_t count) {
+			const size_t data_offset = (sizeof(ListFileHeader) + alignof(T) - 1) / alignof(T) * alignof(T);
+			return data_offset + count * sizeof(T);
+		}
+
+		/**
+		* Grows the file behind @param fd to hold @param capacity values and maps it shared
+		* @return the mapping or NULL on failure
+		*/
+		static char* mapListFile(int fd, uint64_t capacity) {
+			if (ftruncate(fd, listFileSize(capacity)) == -1) {
+				return NULL;
+			}
+			void* map = mmap(NULL, listFileSize(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			return map == MAP_FAILED ? NULL : (char*)map;
+		}
+
+		static void closeAndUnlink(int fd, const std::string& path) {
+			int saved_errno = errno;
+			close(fd);
+			unlink(path.c_str());
+			errno = saved_errno;
+		}
+
+		/**
+		* Hand-over state between the segments of forEachSegment(): handoffs[i].pred is the locked node
+		* before segment i (ready once set) and started is set once segment i's first node is locked.
+		* ended is set once a segment ran into the end of the list, the segments after it have nothing to visit
+		*/
+		struct SegmentChain {
+			struct Handoff {
+				Link *pred;
+				bool ready;
+				bool started;
+				Handoff() : pred(NULL), ready(false), started(false) {}
+			};
+			std::vector<Handoff> handoffs;
+			bool ended;
+			pthread_mutex_t chain_mutex;
+			pthread_cond_t chain_cond;
+
+			explicit SegmentChain(unsigned long segments_num) : handoffs(segments_num), ended(false) {
+				pthread_mutex_init(&chain_mutex, NULL);
+				pthread_cond_init(&chain_cond, NULL);
+			}
+
+			~SegmentChain() {
+				pthread_cond_destroy(&chain_cond);
+				pthread_mutex_destroy(&chain_mutex);
+			}
+		};
+
+		/**
+		* Cuts the list into up to SEGMENTS_PER_THREAD segments per thread (sized from the current size),
+		* calls @param on_segments(segments_num) and then @param visit(segment, data) for every value,
+		* the segments being tasks of a WorkStealingPool of @param threads_num threads (the calling one included).
+		* A segment's task locks its nodes once the one before has handed over its locked last node, hands its
+		* own last node over and only then visits and unlocks its nodes, so the visits of the segments overlap
+		* and only the pointer walk that locks them runs in list order. The last node stays locked until the
+		* next segment's first node is, and if no thread has taken that segment yet its task is run right away
+		* by the same thread. Every node is unlocked by the thread that locked it
+		*/
+		template <typename Visit, typename OnSegments>
+		void forEachSegment(Visit visit, unsigned int threads_num, OnSegments on_segments) {
+			if (threads_num == 0) {
+				long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+				threads_num = cpus > 0 ? cpus : 1;
+			}
+			pthread_mutex_lock(&list_mutex);
+			unsigned long nodes_num = size;
+			pthread_mutex_unlock(&list_mutex);
+			unsigned long segments_num = std::min<unsigned long>(nodes_num, (unsigned long)threads_num * SEGMENTS_PER_THREAD);
+			unsigned long segment_len = segments_num > 0 ? (nodes_num + segments_num - 1) / segments_num : 0;
+			if (segment_len > 0) {
+				segments_num = (nodes_num + segment_len - 1) / segment_len;
+			}
+			on_segments(segments_num);
+			if (segments_num == 0) {
+				return;
+			}
+
+			SegmentChain chain(segments_num);
+			WorkStealingPool pool(std::min<unsigned long>(threads_num, segments_num));
+			pool.run(segments_num, [&](unsigned int segment) {
+				// the last node of the segment before, when this thread locked it
+				Link *held = NULL;
+				while (true) {
+					Link *pred;
+					if (segment == 0) {
+						// the head stands in for the last node of a segment before the first one
+						pthread_mutex_lock(&head->node_mutex);
+						pred = head;
+						held = head;
+					} else {
+						pthread_mutex_lock(&chain.chain_mutex);
+						while (!chain.handoffs[segment].ready && !chain.ended) {
+							pthread_cond_wait(&chain.chain_cond, &chain.chain_mutex);
+						}
+						bool skip = !chain.handoffs[segment].ready;
+						pred = chain.handoffs[segment].pred;
+						pthread_mutex_unlock(&chain.chain_mutex);
+						if (skip) {
+							return;
+						}
+					}
+
+					// pred is locked by the thread of the previous segment, which waits for started
+					Node *start = pred->next;
+					if (start != NULL) {
+						pthread_mutex_lock(&start->node_mutex);
+					}
+					pthread_mutex_lock(&chain.chain_mutex);
+					chain.handoffs[segment].started = true;
+					if (start == NULL) {
+						// the list got shorter since size was read
+						chain.ended = true;
+					}
+					pthread_cond_broadcast(&chain.chain_cond);
+					pthread_mutex_unlock(&chain.chain_mutex);
+					if (held != NULL) {
+						pthread_mutex_unlock(&held->node_mutex);
+						held = NULL;
+					}
+					if (start == NULL) {
+						return;
+					}
+
+					// the last segment takes whatever is left
+					bool is_last = segment == segments_num - 1;
+					unsigned long len = 1;
+					Node *last = start;
+					while (last->next != NULL && (is_last || len < segment_len)) {
+						pthread_mutex_lock(&last->next->node_mutex);
+						last = last->next;
+						len++;
+					}
+					bool ended = !is_last && last->next == NULL;
+					if (!is_last) {
+						pthread_mutex_lock(&chain.chain_mutex);
+						if (ended) {
+							chain.ended = true;
+						} else {
+							chain.handoffs[segment + 1].pred = last;
+							chain.handoffs[segment + 1].ready = true;
+						}
+						pthread_cond_broadcast(&chain.chain_cond);
+						pthread_mutex_unlock(&chain.chain_mutex);
+					}
+
+					Node *node = start;
+					for (unsigned long j = 0; j < len; ++j, node = node->next) {
+						visit(segment, static_cast<const T&>(node->data));
+					}
+					node = start;
+					while (node != last) {
+						Node *next = node->next;
+						pthread_mutex_unlock(&node->node_mutex);
+						node = next;
+					}
+					if (is_last || ended) {
+						pthread_mutex_unlock(&last->node_mutex);
+						return;
+					}
+
+					// the next segment's thread needs last until it has locked its first node
+					held = last;
+					if (pool.claim(segment + 1)) {
+						segment++;
+						continue;
+					}
+					pthread_mutex_lock(&chain.chain_mutex);
+					while (!chain.handoffs[segment + 1].started) {
+						pthread_cond_wait(&chain.chain_cond, &chain.chain_mutex);
+					}
+					pthread_mutex_unlock(&chain.chain_mutex);
+					pthread_mutex_unlock(&held->node_mutex);
+					return;
+				}
+			});
+		}
+
+		template <typename Visit>
+		void forEachSegment(Visit visit, unsigned int threads_num) {
+			forEachSegment(visit, threads_num, [](unsigned int) {});
+		}
+
+		/**
+		* Walks hand-over-hand to the last link before the data >= @param lo and then keeps locking,
+		* without unlocking, every node whose data is <= @param hi.
+		* All the locked links are appended to @param locked
+		* @return the link before the range (locked, and the first entry of locked)
+		*/
+		Link* lockRange(const T& lo, const T& hi, std::vector<Link*>& locked) {
+			Link *prev = head;
+			pthread_mutex_lock(&prev->node_mutex);
+			while (prev->next != NULL && !(lo <= prev->next->data)) {
+				Link *curr = prev->next;
+				pthread_mutex_lock(&curr->node_mutex);
+				pthread_mutex_unlock(&prev->node_mutex);
+				prev = curr;
+			}
+			locked.push_back(prev);
+			for (Link *curr = prev; curr->next != NULL && curr->next->data <= hi; curr = curr->next) {
+				pthread_mutex_lock(&curr->next->node_mutex);
+				locked.push_back(curr->next);
+			}
+			return prev;
+		}
+
+		/**
+		* Keeps the arenas of @param source alive for as long as this list: nodes from them,
+		* or from arenas they borrowed in turn, are about to be linked into this list
+		*/
+		void borrowArenas(List& source) {
+			pthread_mutex_lock(&source.list_mutex);
+			std::vector<std::shared_ptr<NodeArena> > arenas(source.borrowed_arenas);
+			pthread_mutex_unlock(&source.list_mutex);
+			arenas.push_back(source.arena);
+
+			pthread_mutex_lock(&list_mutex);
+			for (unsigned int i = 0; i < arenas.size(); ++i) {
+				if (arenas[i] != arena
+				    && std::find(borrowed_arenas.begin(), borrowed_arenas.end(), arenas[i]) == borrowed_arenas.end()) {
+					borrowed_arenas.push_back(arenas[i]);
+				}
+			}
+			pthread_mutex_unlock(&list_mutex);
+		}
+
+		template <typename... Args>
+		Node* allocNode(Args&&... args) {
+			void *slot = arena->allocate();
+			try {
+				return new (slot) Node(std::forward<Args>(args)...);
+			} catch (...) {
+				arena->deallocate(slot);
+				throw;
+			}
+		}
+
+		void freeNode(Node *node) {
+			node->~Node();
+			// the slot may come from a borrowed arena, which is fine: all slots have the same size
+			// and borrowed arenas live as long as this one's free list can hand them out
+			arena->deallocate(node);
+		}
+
+		/**
+		* Links the node returned by @param make_node after the last node whose data is smaller than @param key.
+		* make_node is called only once the position is known and locked, and key is not read afterwards,
+		* so make_node may move from it
+		* @return true if a new node was added and false if @param key is already in the list
+		*/
+		template <typename MakeNode>
+		bool insertNode(const T& key, MakeNode make_node) {
+			// lock dummy node
+			Link *prev = head;
+			pthread_mutex_lock(&prev->node_mutex);
+
+			if (prev->next == NULL) {
+				// in case list is empty
+				Node* newNode = make_node();
+				prev->next = newNode;
+				pthread_mutex_lock(&list_mutex);
+				size++;
+				pthread_mutex_unlock(&list_mutex);
+				__add_hook();
+				pthread_mutex_unlock(&prev->node_mutex);
+				return true;
+			}
+
+			Link *curr = prev;
+
+			// iterating over the list
+			while (curr->next != NULL && curr->next->data <= key){
+				if (curr->next->data == key){
+					// value exists in list, unlock and return false
+					pthread_mutex_unlock(&curr->node_mutex);
+					return false;
+				}
+				prev = curr;
+				curr = curr->next;
+				pthread_mutex_lock(&curr->node_mutex);
+				pthread_mutex_unlock(&prev->node_mutex);
+			}
+
+			// adding new node
+			Node *newNode = make_node();
+			newNode->next = curr->next;
+			curr->next = newNode;
+			pthread_mutex_lock(&list_mutex);
+			size++;
+			pthread_mutex_unlock(&list_mutex);
+			__add_hook();
+			pthread_mutex_unlock(&curr->node_mutex);
+			return true;
+		}
+
+		Link* head;
+		std::shared_ptr<NodeArena> arena;
+		// arenas of other lists that nodes linked into this list came from (guarded by list_mutex)
+		std::vector<std::shared_ptr<NodeArena> > borrowed_arenas;
 		unsigned int size;
 		pthread_mutex_t list_mutex;
 };
@@ -0,0 +1,145 @@
+#include "ThreadSafeList.h"
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <chrono>
+#include <new>
+
+// g++ -std=c++11 -O2 -pthread listBench.cpp -o listBench
+
+#define KEYS_NUM 5000
+#define KEY_LENGTH 48   // long enough to defeat std::string's small buffer
+#define CLEAR_NODES_NUM 1000000
+#define CHECKPOINT_PATH "/tmp/listBench.ckpt"
+
+using std::string;
+using std::vector;
+
+static unsigned long allocations = 0;
+
+__attribute__((noinline)) void* operator new(size_t n) {
+	allocations++;
+	void* p = malloc(n);
+	if (p == nullptr) throw std::bad_alloc();
+	return p;
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept { free(p); }
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { free(p); }
+
+vector<string> makeKeys() {
+	vector<string> keys;
+	keys.reserve(KEYS_NUM);
+	for (int i = 0; i < KEYS_NUM; ++i) {
+		string key = std::to_string(i);
+		keys.push_back(string(KEY_LENGTH - key.length(), '0') + key);
+	}
+	// shuffled, so inserts don't all walk the whole list
+	srand(1);
+	for (int i = KEYS_NUM - 1; i > 0; --i) {
+		std::swap(keys[i], keys[rand() % (i + 1)]);
+	}
+	return keys;
+}
+
+double elapsedMs(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <typename InsertFunc>
+void run(List<string>& list, const char* name, InsertFunc insert_func) {
+	vector<string> keys = makeKeys();
+	unsigned long before = allocations;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < KEYS_NUM; ++i) {
+		insert_func(list, keys[i]);
+	}
+	double ms = elapsedMs(start);
+	cout << left << setw(24) << name << right << setw(8) << fixed << setprecision(2)
+	     << (double)(allocations - before) / KEYS_NUM << " allocs/insert" << setw(10) << ms << " ms" << endl;
+	// reset for the next run
+	list.clear();
+}
+
+void runClearAndRestore() {
+	List<int> list;
+	// descending order, so every insert stops right after the head
+	auto start = std::chrono::steady_clock::now();
+	for (int i = CLEAR_NODES_NUM; i > 0; --i) {
+		list.insert(i);
+	}
+	cout << left << setw(24) << "insert() 1M ints" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+
+	start = std::chrono::steady_clock::now();
+	list.checkpoint(CHECKPOINT_PATH);
+	cout << left << setw(24) << "checkpoint() 1M ints" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+
+	start = std::chrono::steady_clock::now();
+	list.clear();
+	cout << left << setw(24) << "clear() 1M ints" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+
+	start = std::chrono::steady_clock::now();
+	list.restore(CHECKPOINT_PATH);
+	cout << left << setw(24) << "restore() 1M ints" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+	unlink(CHECKPOINT_PATH);
+}
+
+void runParallel() {
+	List<int> list;
+	for (int i = CLEAR_NODES_NUM; i > 0; --i) {
+		list.insert(i);
+	}
+	const unsigned int threads_nums[] = {1, 0};
+	for (unsigned int threads_num : threads_nums) {
+		auto start = std::chrono::steady_clock::now();
+		list.parallelReduce(0LL,
+				[](long long acc, const int& x) { return acc + x; },
+				[](long long a, long long b) { return a + b; }, threads_num);
+		string name = string("parallelReduce() sum ") + (threads_num == 1 ? "x1" : "xN");
+		cout << left << setw(24) << name << right << setw(8) << elapsedMs(start) << " ms" << endl;
+	}
+}
+
+#define MOVES_NUM 10000
+
+void runMoves() {
+	List<int> pending;
+	List<int> done;
+	for (int i = MOVES_NUM; i > 0; --i) {
+		pending.insert(i);
+	}
+
+	// every other item, remove + insert vs. moveTo
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 2; i <= MOVES_NUM; i += 2) {
+		pending.remove(i);
+		done.insert(i);
+	}
+	cout << left << setw(24) << "remove()+insert() 5k" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+	for (int i = 2; i <= MOVES_NUM; i += 2) {
+		done.remove(i);
+		pending.insert(i);
+	}
+	start = std::chrono::steady_clock::now();
+	for (int i = 2; i <= MOVES_NUM; i += 2) {
+		pending.moveTo(done, i);
+	}
+	cout << left << setw(24) << "moveTo() 5k" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+
+	// the odd half goes over in one call, merged between the even keys; 1 is already there
+	done.insert(1);
+	pending.remove(MOVES_NUM - 1);
+	start = std::chrono::steady_clock::now();
+	pending.transferRange(0, MOVES_NUM, done);
+	cout << left << setw(24) << "transferRange() 5k" << right << setw(8) << elapsedMs(start) << " ms" << endl;
+}
+
+int main() {
+	List<string> list;
+	run(list, "insert(const T&)", [](List<string>& l, string& key) { l.insert(key); });
+	run(list, "insert(T&&)", [](List<string>& l, string& key) { l.insert(std::move(key)); });
+	run(list, "emplace(const char*)", [](List<string>& l, string& key) { l.emplace(key.c_str()); });
+	runClearAndRestore();
+	runParallel();
+	runMoves();
+	return 0;
+}
@@ -3,10 +3,16 @@
 #include <algorithm>
 #include <cassert>
 #include <fstream>
+#include <atomic>
+#include <unistd.h>
 
 #define TEST_NUM 100
 #define MAX_ACTIONS 50
 #define NUM_RANGE 100
+#define BIG_LIST_SIZE 100000
+#define WRITERS_NUM 4
+#define MOVES_NUM 2000
+#define CHECKPOINT_PATH "/tmp/listTest.ckpt"
 
 //      Don't change those      vvv
 #define INSERT ((rand() % 100) % 5 >= 3)
@@ -64,6 +70,185 @@ int generateNum(bool* nums) {
 	return num;
 }
 
+void testCheckpointRestore() {
+	List<int> list;
+	for (int k = BIG_LIST_SIZE; k > 0; --k) {
+		list.insert(k);
+	}
+	bool ok = list.checkpoint(CHECKPOINT_PATH);
+	assert(ok);
+	list.clear();
+	assert(list.getSize() == 0);
+	ok = list.insert(7);
+	assert(ok);
+
+	// restore() replaces whatever is in the list
+	ok = list.restore(CHECKPOINT_PATH);
+	assert(ok);
+	assert(list.getSize() == BIG_LIST_SIZE);
+	ok = list.insert(1);
+	assert(!ok);
+	ok = list.insert(BIG_LIST_SIZE);
+	assert(!ok);
+	ok = list.insert(BIG_LIST_SIZE + 1);
+	assert(ok);
+	ok = list.remove(7);
+	assert(ok);
+	ok = list.remove(7);
+	assert(!ok);
+
+	// a missing file leaves the list empty
+	unlink(CHECKPOINT_PATH);
+	ok = list.restore(CHECKPOINT_PATH);
+	assert(!ok);
+	assert(list.getSize() == 0);
+	ok = list.insert(1);
+	assert(ok);
+}
+
+struct writerArgs {
+	List<int>* list;
+	int id;
+	std::atomic<bool>* stop;
+};
+
+/**
+* Keeps inserting and removing its own keys, all above BIG_LIST_SIZE, until told to stop
+*/
+void* churn(void* args) {
+	auto wArgs = (writerArgs*)args;
+	for (int round = 0; !*wArgs->stop || round == 0; ++round) {
+		for (int k = 0; k < 100; ++k) {
+			int key = BIG_LIST_SIZE + 1 + k * WRITERS_NUM + wArgs->id;
+			bool ok = wArgs->list->insert(key);
+			assert(ok);
+			ok = wArgs->list->remove(key);
+			assert(ok);
+		}
+	}
+	return nullptr;
+}
+
+void testParallel() {
+	List<int> list;
+	for (int k = BIG_LIST_SIZE; k > 0; --k) {
+		list.insert(k);
+	}
+	const long long expected_sum = (long long)BIG_LIST_SIZE * (BIG_LIST_SIZE + 1) / 2;
+	const unsigned int threads_nums[] = {1, 3, 0};
+	for (unsigned int threads_num : threads_nums) {
+		long long sum = list.parallelReduce(0LL,
+				[](long long acc, const int& x) { return acc + x; },
+				[](long long a, long long b) { return a + b; }, threads_num);
+		assert(sum == expected_sum);
+	}
+
+	std::vector<int> exported = list.parallelReduce(std::vector<int>(),
+			[](std::vector<int> acc, const int& x) { acc.push_back(x); return acc; },
+			[](std::vector<int> a, std::vector<int> b) { a.insert(a.end(), b.begin(), b.end()); return a; }, 4);
+	assert(exported.size() == BIG_LIST_SIZE && std::is_sorted(exported.begin(), exported.end()));
+
+	// R = bool: every segment writes its own partial
+	bool all_positive = list.parallelReduce(true,
+			[](bool acc, const int& x) { return acc && x > 0; },
+			[](bool a, bool b) { return a && b; }, 4);
+	assert(all_positive);
+
+	List<int> empty;
+	int empty_sum = empty.parallelReduce(5, [](int acc, const int& x) { return acc + x; },
+	                                     [](int a, int b) { return a + b; });
+	assert(empty_sum == 5);
+
+	// writers keep changing the tail of the list while it is visited
+	std::atomic<bool> stop(false);
+	pthread_t threads[WRITERS_NUM];
+	writerArgs wArgs[WRITERS_NUM];
+	for (int i = 0; i < WRITERS_NUM; ++i) {
+		wArgs[i].list = &list;
+		wArgs[i].id = i;
+		wArgs[i].stop = &stop;
+		pthread_create(threads + i, nullptr, churn, (void*)&wArgs[i]);
+	}
+	for (int round = 0; round < 20; ++round) {
+		std::atomic<long long> sum(0);
+		std::atomic<int> count(0);
+		list.parallelForEach([&sum, &count](const int& x) {
+			if (x <= BIG_LIST_SIZE) {
+				sum += x;
+				count++;
+			}
+		}, 4);
+		assert(count == BIG_LIST_SIZE && sum == expected_sum);
+	}
+	stop = true;
+	JOIN(WRITERS_NUM)
+	assert(list.getSize() == BIG_LIST_SIZE);
+}
+
+struct moverArgs {
+	List<int>* from;
+	List<int>* to;
+	int parity;
+};
+
+/**
+* Moves every key of its parity from one list to the other, one moveTo() at a time
+*/
+void* mover(void* args) {
+	auto mArgs = (moverArgs*)args;
+	for (int k = mArgs->parity; k < MOVES_NUM; k += 2) {
+		bool ok = mArgs->from->moveTo(*mArgs->to, k);
+		assert(ok);
+	}
+	return nullptr;
+}
+
+void testMoves() {
+	// evens start in a, odds in b; two threads swap them around at the same time
+	List<int> a;
+	List<int> b;
+	for (int k = 0; k < MOVES_NUM; ++k) {
+		(k % 2 == 0 ? a : b).insert(k);
+	}
+	pthread_t threads[2];
+	moverArgs args[2] = {{&a, &b, 0}, {&b, &a, 1}};
+	pthread_create(threads, nullptr, mover, (void*)&args[0]);
+	pthread_create(threads + 1, nullptr, mover, (void*)&args[1]);
+	JOIN(2)
+	assert(a.getSize() == MOVES_NUM / 2 && b.getSize() == MOVES_NUM / 2);
+	for (int k = 0; k < MOVES_NUM; ++k) {
+		List<int>& holder = k % 2 == 0 ? b : a;
+		List<int>& other = k % 2 == 0 ? a : b;
+		bool ok = other.moveTo(holder, k);
+		assert(!ok);
+		ok = holder.remove(k);
+		assert(ok);
+		ok = holder.insert(k);
+		assert(ok);
+	}
+
+	// a key already in the other list stays where it is
+	bool ok = a.insert(0);
+	assert(ok);
+	ok = a.moveTo(b, 0);
+	assert(!ok && a.getSize() == MOVES_NUM / 2 + 1);
+
+	// the odds go back to b in one call, merged between the evens
+	unsigned int moved = a.transferRange(0, MOVES_NUM, b);
+	assert(moved == MOVES_NUM / 2 && a.getSize() == 1 && b.getSize() == MOVES_NUM);
+	std::vector<int> merged = b.parallelReduce(std::vector<int>(),
+			[](std::vector<int> acc, const int& x) { acc.push_back(x); return acc; },
+			[](std::vector<int> v, std::vector<int> w) { v.insert(v.end(), w.begin(), w.end()); return v; });
+	assert(merged.size() == MOVES_NUM && std::is_sorted(merged.begin(), merged.end()));
+
+	// the evens in b came from a's arena, which must outlive a's clear()
+	a.clear();
+	ok = b.remove(2);
+	assert(ok);
+	ok = b.insert(2);
+	assert(ok);
+}
+
 int main() {
 	pthread_t threads[MAX_ACTIONS];
 	threadArgs args[MAX_ACTIONS];
@@ -78,6 +263,10 @@ int main() {
 	res.open("test_res");
 	srand(time(0));
 
+	testCheckpointRestore();
+	testParallel();
+	testMoves();
+
 	assert(list.getSize() == 0);
 
 	// Insertion and deletion, threadless